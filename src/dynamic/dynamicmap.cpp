@@ -22,15 +22,34 @@ class DynamicHeightmapDrawable : public base::Drawable {
 	Landscape* m_land;
 	struct PatchTag {
 		base::HardwareVertexBuffer* vertexBuffer;
-		base::HardwareIndexBuffer* indexBuffer;
 		uint binding;
 	};
+	std::map<uint, base::HardwareIndexBuffer*> m_indexBuffers; // Shared by edge configuration
 	public:
 	DynamicHeightmapDrawable(Landscape* land) : m_land(land) {
 		m_land->setPatchCallbacks( ::bind(this, &DynamicHeightmapDrawable::patchCreated),
 		                           ::bind(this, &DynamicHeightmapDrawable::patchDetroyed),
 								   ::bind(this, &DynamicHeightmapDrawable::patchUpdated));
 	}
+	~DynamicHeightmapDrawable() {
+		for(auto& i: m_indexBuffers) i.second->dropReference();
+	}
+	base::HardwareIndexBuffer* getIndexBuffer(const PatchGeometry* patch) {
+		base::HardwareIndexBuffer*& buffer = m_indexBuffers[patch->indexKey];
+		if(!buffer) {
+			if(patch->indexSize==4) {
+				buffer = new base::HardwareIndexBuffer(32);
+				buffer->setData(static_cast<const uint*>(patch->indices), patch->indexCount);
+			}
+			else {
+				buffer = new base::HardwareIndexBuffer(16);
+				buffer->setData(static_cast<const uint16*>(patch->indices), patch->indexCount);
+			}
+			buffer->createBuffer();
+			buffer->addReference();
+		}
+		return buffer;
+	}
 	void draw(base::RenderState& r) {
 		base::Camera cam = *r.getCamera();
 		cam.setPosition( cam.getPosition() - vec3(&getTransform()[12]));
@@ -41,9 +60,10 @@ class DynamicHeightmapDrawable : public base::Drawable {
 		for(const PatchGeometry* g: m_land->getGeometry()) {
 			PatchTag* tag = (PatchTag*)g->tag;
 			if(tag) {
+				base::HardwareIndexBuffer* indices = getIndexBuffer(g);
 				glBindVertexArray(tag->binding);
-				tag->indexBuffer->bind(); // Because it is not part of the buffer for some bizarre reason
-				glDrawElements(GL_TRIANGLE_STRIP, g->indexCount, tag->indexBuffer->getDataType(), 0);
+				indices->bind();
+				glDrawElements(GL_TRIANGLE_STRIP, g->indexCount, indices->getDataType(), 0);
 			}
 		}
 	}
@@ -57,30 +77,20 @@ class DynamicHeightmapDrawable : public base::Drawable {
 		tag->vertexBuffer->setData(patch->vertices, patch->vertexCount, 10*sizeof(float));
 		tag->vertexBuffer->createBuffer();
 		tag->vertexBuffer->addReference();
-
-		tag->indexBuffer = new base::HardwareIndexBuffer();
-		tag->indexBuffer->setData(patch->indices, patch->indexCount);
-		tag->indexBuffer->createBuffer();
-		tag->indexBuffer->addReference();
 		
 		m_binding = 0;
 		addBuffer(tag->vertexBuffer);
-		addBuffer(tag->indexBuffer);
 		tag->binding = m_binding;
 		m_binding = 0;
 	}
 	void patchUpdated(PatchGeometry* patch) {
 		PatchTag* tag = (PatchTag*)patch->tag;
-		if(tag) {
-			tag->vertexBuffer->setData(patch->vertices, patch->vertexCount, 10*sizeof(float));
-			tag->indexBuffer->setData(patch->indices, patch->indexCount);
-		}
+		if(tag) tag->vertexBuffer->setData(patch->vertices, patch->vertexCount, 10*sizeof(float));
 	}
 	void patchDetroyed(PatchGeometry* patch) {
 		PatchTag* tag = (PatchTag*)patch->tag;
 		if(tag) {
 			glDeleteVertexArrays(1, &tag->binding);
-			tag->indexBuffer->dropReference();
 			tag->vertexBuffer->dropReference();
 			patch->tag = nullptr;
 			delete tag;
@@ -90,10 +100,14 @@ class DynamicHeightmapDrawable : public base::Drawable {
 
 // =================================== //
 
-DynamicHeightmap::DynamicHeightmap() : m_width(0), m_height(0), m_resolution(0), m_heightData(0), m_land(0), m_material(0) {
+DynamicHeightmap::DynamicHeightmap() : m_width(0), m_height(0), m_resolution(0), m_heightData(0), m_land(0), m_material(0), m_patchSize(9), m_adjacent{0,0,0,0} {
 }
 DynamicHeightmap::~DynamicHeightmap() {
-	delete m_land;
+	// Disconnect tiles without refreshing this one
+	Landscape* land = m_land;
+	m_land = 0;
+	for(int i=0; i<4; ++i) connect(0, i);
+	delete land;
 	delete [] m_heightData;
 	for(base::Drawable* d: m_drawables) delete d;
 	delete m_material;
@@ -104,32 +118,37 @@ void DynamicHeightmap::setup(int w, int h, float r) {
 	m_height = h;
 	m_resolution = r;
 	delete [] m_heightData;
-	int p = 0;
+	int p = 0, step = 0;
 	while((1<<p)<w) ++p;
+	while((1<<step)<m_patchSize-1) ++step;
 	m_heightData = new float[w*h];
 	m_land = new Landscape(w&~1);
-	m_land->setLimits(0, p-3);
+	m_land->setPatchSize(m_patchSize);
+	m_land->setLimits(0, p-step);
 }
 
 void DynamicHeightmap::create(int w, int h, float res, const ubyte* data, int stride, float scale, float offset) {
 	setup(w,h,res);
 	int size = w * h;
 	for(int i=0; i<size; ++i) m_heightData[i] = data[i] * scale + offset;
-	m_land->setHeightFunction( bind(this, &DynamicHeightmap::heightFunc) );
+	m_land->setHeightFunction( bind(this, &DynamicHeightmap::heightFunc), bind(this, &DynamicHeightmap::heightBlockFunc) );
+	m_land->createHeightTree(res);
 }
 
 void DynamicHeightmap::create(int w, int h, float res, const float* data) {
 	setup(w,h,res);
 	int size = w * h;
 	for(int i=0; i<size; ++i) m_heightData[i] = data[i];
-	m_land->setHeightFunction( bind(this, &DynamicHeightmap::heightFunc) );
+	m_land->setHeightFunction( bind(this, &DynamicHeightmap::heightFunc), bind(this, &DynamicHeightmap::heightBlockFunc) );
+	m_land->createHeightTree(res);
 }
 
 void DynamicHeightmap::create(int w, int h, float res, const float height) {
 	setup(w,h,res);
 	int size = w * h;
 	for(int i=0; i<size; ++i) m_heightData[i] = height;
-	m_land->setHeightFunction( bind(this, &DynamicHeightmap::heightFunc) );
+	m_land->setHeightFunction( bind(this, &DynamicHeightmap::heightFunc), bind(this, &DynamicHeightmap::heightBlockFunc) );
+	m_land->createHeightTree(res);
 }
 
 void DynamicHeightmap::setMaterial(DynamicMaterial* dyn, const MapList& maps) {
@@ -191,6 +210,10 @@ float DynamicHeightmap::getHeight(const vec3& p) const {
 
 float DynamicHeightmap::getHeight(int x, int y) const {
 	if(!m_heightData) return 0;
+	if(x<0 && m_adjacent[0]) return m_adjacent[0]->getHeight(x + m_adjacent[0]->m_width - 1, y);
+	if(x>=m_width && m_adjacent[1]) return m_adjacent[1]->getHeight(x - m_width + 1, y);
+	if(y<0 && m_adjacent[2]) return m_adjacent[2]->getHeight(x, y + m_adjacent[2]->m_height - 1);
+	if(y>=m_height && m_adjacent[3]) return m_adjacent[3]->getHeight(x, y - m_height + 1);
 	if(x<0) x=0;
 	else if(x>=m_width) x=m_width-1;
 	if(y<0) y=0;
@@ -239,10 +262,76 @@ float DynamicHeightmap::heightFunc(const vec3& p) {
 	return height(p.x, p.z);
 }
 
+void DynamicHeightmap::heightBlockFunc(const vec3& origin, float step, const Rect& r, float* out) {
+	fillHeights(origin, step, r, out);
+}
+
+void DynamicHeightmap::fillHeights(const vec3& origin, float step, const Rect& r, float* out) const {
+	// Read directly from the array if samples lie on pixels
+	float s = step / m_resolution;
+	float x = origin.x / m_resolution + r.x * s;
+	float y = origin.z / m_resolution + r.y * s;
+	if(s!=floor(s) || x!=floor(x) || y!=floor(y)) {
+		HeightmapInterface::fillHeights(origin, step, r, out);
+		return;
+	}
+	for(int j=0; j<r.height; ++j) {
+		for(int i=0; i<r.width; ++i) *out++ = getHeight(int(x + i*s), int(y + j*s));
+	}
+}
+
+void DynamicHeightmap::connect(HeightmapInterface* map, int side) {
+	DynamicHeightmap* other = dynamic_cast<DynamicHeightmap*>(map);
+	DynamicHeightmap* old = m_adjacent[side];
+	DynamicHeightmap* replaced = other? other->m_adjacent[side^1]: 0;
+	if(other == old) return;
+	if(old) old->m_adjacent[side^1] = 0;
+	if(replaced) replaced->m_adjacent[side] = 0;
+	m_adjacent[side] = other;
+	if(other) other->m_adjacent[side^1] = this;
+	if(m_land) m_land->connect(other? other->m_land: 0, side);
+
+	// Edge normals now read the other tile, or clamp again
+	refreshEdge(side);
+	if(other) other->refreshEdge(side^1);
+	if(old) old->refreshEdge(side^1);
+	if(replaced) replaced->refreshEdge(side);
+}
+
+void DynamicHeightmap::refreshEdge(int side) {
+	if(!m_land) return;
+	Rect r(0, 0, m_width, m_height);
+	switch(side) {
+	case 0: r.width = 1; break;
+	case 1: r.x = m_width - 1; r.width = 1; break;
+	case 2: r.height = 1; break;
+	case 3: r.y = m_height - 1; r.height = 1; break;
+	}
+	const float res = m_resolution;
+	m_land->updateGeometry( BoundingBox(r.left()*res, 0, r.top()*res, r.right()*res, 0, r.bottom()*res), true );
+}
+
+void DynamicHeightmap::updateBorder(const Rect& r) {
+	// Tile normals read one sample into connected tiles
+	for(int i=0; i<4; ++i) {
+		const DynamicHeightmap* map = m_adjacent[i];
+		if(!map || !map->m_land) continue;
+		Rect s = r;
+		switch(i) {
+		case 0: if(r.left() > 1) continue; s.x += map->m_width - 1; break;
+		case 1: if(r.right() < m_width - 1) continue; s.x -= m_width - 1; break;
+		case 2: if(r.top() > 1) continue; s.y += map->m_height - 1; break;
+		case 3: if(r.bottom() < m_height - 1) continue; s.y -= m_height - 1; break;
+		}
+		const float res = map->m_resolution;
+		map->m_land->updateGeometry( BoundingBox(s.left()*res, 0, s.top()*res, s.right()*res, 0, s.bottom()*res), true );
+	}
+}
+
 int DynamicHeightmap::trace(const Ray& ray, float& t) const {
 	if(!m_land) return 0;
 	vec3 point, normal;
-	int r = m_land->intersect(ray.start, ray.point(1e6f), point, normal);
+	int r = m_land->intersect(ray.start, ray.point(t<1e6f? t: 1e6f), point, normal);
 	if(r) t = ray.direction.dot(point - ray.start);
 	return r;
 }
@@ -263,6 +352,7 @@ void DynamicHeightmapEditor::apply(const Rect& r) {
 	if(r.width>0 && r.height>0) {
 		const float res = m_map->m_resolution;
 		m_map->m_land->updateGeometry( BoundingBox(r.left()*res, 0, r.top()*res, r.right()*res, 0, r.bottom()*res), true );
+		m_map->updateBorder(r);
 	}
 }
 
@@ -18,6 +18,8 @@ class DynamicHeightmap : public HeightmapInterface {
 	int trace(const Ray& ray, float& t) const override;
 	float getHeight(const vec3& point) const override;
 	void setMaterial(class DynamicMaterial*, const MapList&) override;
+	void fillHeights(const vec3& origin, float step, const Rect& rect, float* out) const override;
+	void connect(HeightmapInterface*, int side) override;
 
 	void setData(const float* data) override;
 	void getData(float* out) const override;
@@ -32,14 +34,20 @@ class DynamicHeightmap : public HeightmapInterface {
 
 	void setMaterial(base::Material*);
 
+	/** Vertices along a landscape patch edge, power of 2 plus 1. Applied by the next create call */
+	void setPatchSize(int size) { m_patchSize = size; }
+
 	float height( float x, float z ) const;
 	float height( float x, float z, vec3& normal) const;
 
 	private:
 	void setup(int w, int h, float r);
-	float getHeight(int x, int z) const;
+	float getHeight(int x, int z) const;	// Reads connected tiles outside the map, otherwise clamps
 	vec3  getNormal(int x, int z) const;
 	float heightFunc(const vec3&);
+	void  heightBlockFunc(const vec3&, float, const Rect&, float*);
+	void  updateBorder(const Rect& changed);	// Refresh connected tiles whose border normals read changed samples
+	void  refreshEdge(int side);
 
 	int    m_width, m_height;
 	float  m_resolution;
@@ -47,6 +55,8 @@ class DynamicHeightmap : public HeightmapInterface {
 	class Landscape* m_land;
 	std::vector<base::Drawable*> m_drawables;
 	base::Material* m_material;
+	int    m_patchSize;
+	DynamicHeightmap* m_adjacent[4];	// Connected tiles. Edge samples are shared
 };
 
 // Heightmap editor interface
@@ -776,14 +776,31 @@ bool DynamicMaterial::compile() {
 	static const char* vertexShader = 
 	"#version 130\n"
 	"in vec4 vertex;\n"
-	"in vec3 normal;\n"
+	"in vec4 normal;\n"
 	"out vec3 worldNormal;\n"
 	"out vec3 worldPos;\n"
 	"uniform mat4 transform;\n"
+	"uniform vec4 patchOrigin;	// Compact landscape vertices: x, height offset, z, spacing\n"
+	"uniform vec2 patchInfo;	// Compact landscape vertices: height scale, patch size. Zero for float vertices\n"
+	"vec3 decodeNormal(vec2 e) {\n"
+	"	vec3 n = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);\n"
+	"	if(n.y < 0.0) n.xz = (1.0 - abs(n.zx)) * sign(n.xz);\n"
+	"	return normalize(n);\n"
+	"}\n"
 	"void main() {\n"
-	"	gl_Position = transform * vertex;\n"
-	"	worldPos = vertex.xyz;\n"
-	"	worldNormal = normal;\n"
+	"	vec4 pos = vertex;\n"
+	"	vec3 n = normal.xyz;\n"
+	"	if(patchInfo.y > 0.0) {\n"
+	"		int size = int(patchInfo.y);\n"
+	"		pos.x = patchOrigin.x + float(gl_VertexID % size) * patchOrigin.w;\n"
+	"		pos.y = patchOrigin.y + vertex.x * patchInfo.x;\n"
+	"		pos.z = patchOrigin.z + float(gl_VertexID / size) * patchOrigin.w;\n"
+	"		pos.w = 1.0;\n"
+	"		n = decodeNormal(normal.xy / 32767.0);\n"
+	"	}\n"
+	"	gl_Position = transform * pos;\n"
+	"	worldPos = pos.xyz;\n"
+	"	worldNormal = n;\n"
 	"}\n";
 
 	// Compile shader
@@ -2,6 +2,14 @@
 #include "terraineditor/editabletexture.h"
 
 
+void HeightmapInterface::fillHeights(const vec3& origin, float step, const Rect& r, float* out) const {
+	for(int y=0; y<r.height; ++y) for(int x=0; x<r.width; ++x) {
+		*out++ = getHeight( origin + vec3((r.x+x)*step, 0, (r.y+y)*step) );
+	}
+}
+
+// ======================================================================= //
+
 MapGrid::MapGrid(float size, const Range& range) : m_heightRange(range), m_gridSize(size) {
 	m_mapDefinitions.push_back( MapDef{0,0} ); // Null definition for heightmap map
 }
@@ -14,6 +22,9 @@ vec3 MapGrid::getOffset(const Point& p) const {
 	return vec3( p.x*m_gridSize, 0, p.y*m_gridSize);
 }
 
+// Adjacent tiles in heightmap side order
+static const Point tileSides[4] = { Point(-1,0), Point(1,0), Point(0,-1), Point(0,1) };
+
 void MapGrid::assign(const Point& p, TerrainMap* map) {
 	remove(p);
 	if(!map) return;
@@ -26,12 +37,17 @@ void MapGrid::assign(const Point& p, TerrainMap* map) {
 	slot.node = createChild(nodeName, offset);
 	slot.node->attach( map->heightMap->createDrawable() );
 	slot.node->setPosition(offset);
+	for(int i=0; i<4; ++i) {
+		TerrainMap* adjacent = getMap(p + tileSides[i]);
+		if(adjacent) map->heightMap->connect(adjacent->heightMap, i);
+	}
 	updateBounds();
 }
 
 void MapGrid::remove(const Point& p) {
 	auto it = m_slots.find(p);
 	if(it!=m_slots.end() && it->second.node) {
+		for(int i=0; i<4; ++i) it->second.map->heightMap->connect(0, i);
 		// ToDo: Delete drawable - tracked by HeightMap class
 		delete it->second.node;
 		it->second.node = 0;
@@ -130,6 +146,33 @@ float MapGrid::getHeight(const vec3& point) const {
 	return 0;
 }
 
+void MapGrid::fillHeights(const vec3& origin, float step, const Rect& r, float* out) const {
+	// Split the sample grid by tile
+	vec3 start = origin + vec3(r.x, 0, r.y) * step;
+	vec3 end = start + vec3(r.width-1, 0, r.height-1) * step;
+	Point a = getTile(start), b = getTile(end);
+	memset(out, 0, r.width * r.height * sizeof(float));
+	float* tmp = 0;	// Shared by all tiles. No tile part is larger than the rect
+	for(Point p(a.x, a.y); p.y<=b.y; ++p.y) {
+		for(p.x=a.x; p.x<=b.x; ++p.x) {
+			TerrainMap* map = getMap(p);
+			if(!map) continue;
+			// Samples inside this tile
+			vec3 offset = getOffset(p);
+			int x0 = fmax(0, ceil((offset.x - start.x) / step));
+			int y0 = fmax(0, ceil((offset.z - start.z) / step));
+			int x1 = fmin(r.width,  ceil((offset.x + m_gridSize - start.x) / step));
+			int y1 = fmin(r.height, ceil((offset.z + m_gridSize - start.z) / step));
+			if(x0>=x1 || y0>=y1) continue;
+			Rect sub(r.x+x0, r.y+y0, x1-x0, y1-y0);
+			if(!tmp) tmp = new float[r.width * r.height];
+			map->heightMap->fillHeights(origin - offset, step, sub, tmp);
+			for(int y=0; y<sub.height; ++y) memcpy(out + x0 + (y0+y)*r.width, tmp + y*sub.width, sub.width*sizeof(float));
+		}
+	}
+	delete [] tmp;
+}
+
 const BoundingBox& MapGrid::getBounds() const {
 	return m_bounds;
 }
@@ -22,6 +22,10 @@ class HeightmapInterface {
 	virtual void getData(float* out) const = 0;
 	virtual size_t getDataSize() const = 0;
 	virtual void setHeightRange(const Rangef&) {}
+	/// Connect to the heightmap of the adjacent tile on side 0:-x, 1:+x, 2:-z, 3:+z. Null disconnects
+	virtual void connect(HeightmapInterface*, int side) {}
+	/// Get a grid of heights. Sample (x,y) of rect is at origin + (x*step, 0, y*step)
+	virtual void fillHeights(const vec3& origin, float step, const Rect& rect, float* out) const;
 };
 
 
@@ -47,6 +51,7 @@ class MapGrid : public TerrainEditorDataInterface, public base::SceneNode {
 	int trace(const Ray& ray, float& t) const override;
 	float getHeight(const vec3&) const override;
 	float getResolution(unsigned id) const override;
+	void  fillHeights(const vec3& origin, float step, const Rect& rect, float* out) const;
 
 	public:
 	const Range& getHeightRange() const { return m_heightRange; }
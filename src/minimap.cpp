@@ -32,13 +32,13 @@ void MiniMap::setRange(float max, float min) {
 	m_scale = 255 / (max - min);
 }
 
-inline float MiniMap::getWorldHeight(int px, int py) const {
-	vec3 pos;
-	pos.x = (float)px / m_texture.width();
-	pos.z = (float)py / m_texture.height();
-	pos.x = pos.x * m_worldSize.x + m_worldOffset.x;
-	pos.z = pos.z * m_worldSize.y + m_worldOffset.y;
-	return m_map->getHeight(pos);
+void MiniMap::getWorldHeights(int x0, int x1, int py, float* out) const {
+	// Read a row of pixels in one call. Pixel spacing may differ in x and z
+	vec3 origin;
+	origin.x = m_worldOffset.x;
+	origin.z = (float)py / m_texture.height() * m_worldSize.y + m_worldOffset.y;
+	float step = m_worldSize.x / m_texture.width();
+	m_map->fillHeights(origin, step, Rect(x0, 0, x1-x0+1, 1), out);
 }
 
 inline unsigned char clampByte(float v) { return v>0? v<255? v: 255: 0; } 
@@ -50,15 +50,18 @@ void MiniMap::build() {
 	int w = m_texture.width();
 	int h = m_texture.height();
 	float min=1e8f, max=-1e8f;
-	for(int x=0; x<w; ++x) {
-		for(int y=0; y<h; ++y) {
-			float h = getWorldHeight(x, y);
+	float* row = new float[w];
+	for(int y=0; y<h; ++y) {
+		getWorldHeights(0, w-1, y, row);
+		for(int x=0; x<w; ++x) {
+			float h = row[x];
 			if(h<min) min=h;
 			if(h>max) max=h;
 			unsigned char* pixel = m_data + (x + y*w) * 3;
 			pixel[0] = pixel[1] = pixel[2] = clampByte((h - m_base) * m_scale);
 		}
 	}
+	delete [] row;
 	m_texture.setPixels(w, h, Texture::RGB8, m_data);
 	setRange(max, min);
 }
@@ -74,13 +77,15 @@ void MiniMap::update(const vec2& a, const vec2& b) {
 	x1 = clamp(x1, 0, w-1);
 	y0 = clamp(y0, 0, h-1);
 	y1 = clamp(y1, 0, h-1);
-	for(int x=x0; x<=x1; ++x) {
-		for(int y=y0; y<=y1; ++y) {
-			float h = getWorldHeight(x, y);
+	float* row = new float[x1-x0+1];
+	for(int y=y0; y<=y1; ++y) {
+		getWorldHeights(x0, x1, y, row);
+		for(int x=x0; x<=x1; ++x) {
 			unsigned char* pixel = m_data + (x + y*w) * 3;
-			pixel[0] = pixel[1] = pixel[2] = clampByte((h - m_base) * m_scale);
+			pixel[0] = pixel[1] = pixel[2] = clampByte((row[x-x0] - m_base) * m_scale);
 		}
 	}
+	delete [] row;
 	m_texture.setPixels(w, h, Texture::RGB8, m_data);
 }
 
@@ -26,7 +26,7 @@ class MiniMap {
 	vec3 getWorldPosition(const vec2& normalised) const;
 
 	protected:
-	float getWorldHeight(int px, int py) const;
+	void getWorldHeights(int x0, int x1, int py, float* out) const;	// Heights of pixels x0 to x1 of a row
 
 	protected:
 	MapGrid*         m_map;
@@ -1,23 +1,29 @@
 #include <cstdio>
 #include <cstring>
+#include <thread>
 
 #include "bufferedstream.h"
 #include "tiff.h"
 
-BufferedStream::BufferedStream(int bs) : m_stream(0), m_buffer(0), m_changed(false) {
-	m_bufferRect.set(-65535,-65535, bs, bs);
+BufferedStream::BufferedStream(int bs) : m_stream(0), m_bytes(0), m_blockSize(bs), m_cacheSize(0), m_cacheLimit(32<<20), m_prefetchRunning(false) {
+	resetCacheInfo();
 }
 BufferedStream::~BufferedStream() {
 	closeStream();
-	if(m_buffer) delete [] m_buffer;
+	clearCache();
 }
 
-void BufferedStream::setBufferSize(int w, int h) {
+void BufferedStream::setBlockSize(int size) {
 	flush();
-	m_bufferRect.width = w;
-	m_bufferRect.height = h;
-	if(m_buffer) delete [] m_buffer;
-	m_buffer = 0;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	clearCache();
+	m_blockSize = size;
+}
+
+void BufferedStream::setCacheSize(size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_cacheLimit = bytes;
+	while(!m_lru.empty() && m_cacheSize > m_cacheLimit) evictBlock();
 }
 
 bool BufferedStream::openStream(const char* file) {
@@ -26,21 +32,25 @@ bool BufferedStream::openStream(const char* file) {
 	m_stream = TiffStream::openStream(file, TiffStream::READWRITE);
 	if(!m_stream) return printf("ERROR: Failed to open stream\n"), false;
 	m_bytes = m_stream->bpp() / 8;
+	if(m_stream->overviewCount()==0) printf("Stream has no overviews. Sampling full resolution data\n");
 	streamOpened();
 	return true;
 }
-bool BufferedStream::createStream(const char* file, int width, int height, int ch, int bpc, void* init) {
+bool BufferedStream::createStream(const char* file, int width, int height, int ch, int bpc, void* init, int tileSize) {
 	closeStream();
 	printf("Creating stream %s\n", file);
-	m_stream = TiffStream::createStream(file, width, height, ch, bpc, TiffStream::READWRITE, init, ch*(bpc/8));
+	m_stream = TiffStream::createStream(file, width, height, ch, bpc, TiffStream::READWRITE, init, ch*(bpc/8), tileSize);
 	if(!m_stream) return printf("ERROR: Failed to open stream\n"), false;
 	m_bytes = m_stream->bpp() / 8;
+	m_stream->buildOverviews();
 	streamOpened();
 	return true;
 }
 void BufferedStream::closeStream() {
 	if(!m_stream) return;
+	stopPrefetchThread();
 	flush();
+	clearCache();
 	delete m_stream;
 	m_stream = 0;
 }
@@ -60,75 +70,270 @@ int BufferedStream::channels() const {
 
 // =========================================================================== //
 
-inline size_t BufferedStream::getBufferAddress(int x, int y) const {
-	return ((x-m_bufferRect.x) + (y-m_bufferRect.y)*m_bufferRect.width) * m_bytes;
+inline int blockIndex(int v, int size) {
+	return v<0? (v+1)/size-1: v/size;	// Round down for negative values
+}
+
+BufferedStream::Block* BufferedStream::findBlock(const Point& index) {
+	std::map<Point, Block>::iterator it = m_blocks.find(index);
+	if(it == m_blocks.end()) return 0;
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	return &it->second;
+}
+
+BufferedStream::Block& BufferedStream::getBlock(const Point& index, bool read) {
+	if(Block* block = findBlock(index)) return *block;
+
+	size_t bytes = blockBytes();
+	while(!m_lru.empty() && m_cacheSize + bytes > m_cacheLimit) evictBlock();
+
+	Block& block = m_blocks[index];
+	block.data = new ubyte[bytes];
+	block.dirty = false;
+	m_lru.push_front(index);
+	block.lru = m_lru.begin();
+	m_cacheSize += bytes;
+
+	// Parts outside the image are not read
+	memset(block.data, 0, bytes);
+	if(read) m_stream->readBlock(index.x*m_blockSize, index.y*m_blockSize, m_blockSize, m_blockSize, block.data);
+	return block;
+}
+
+int BufferedStream::writeBlock(const Point& index, Block& block) {
+	block.dirty = false;
+	return m_stream->writeBlock(index.x*m_blockSize, index.y*m_blockSize, m_blockSize, m_blockSize, block.data);
+}
+
+void BufferedStream::evictBlock() {
+	Point index = m_lru.back();
+	Block& block = m_blocks[index];
+	if(block.dirty) writeBlock(index, block);
+	delete [] block.data;
+	m_blocks.erase(index);
+	m_lru.pop_back();
+	m_cacheSize -= blockBytes();
+}
+
+void BufferedStream::clearCache() {
+	for(std::map<Point, Block>::iterator i=m_blocks.begin(); i!=m_blocks.end(); ++i) delete [] i->second.data;
+	m_blocks.clear();
+	m_lru.clear();
+	m_cacheSize = 0;
+}
+
+void BufferedStream::copyBlock(const Rect& r, char* data, const Point& index, ubyte* block, bool write) const {
+	// Intersection of rect and block
+	int bx = index.x * m_blockSize;
+	int by = index.y * m_blockSize;
+	int x0 = r.x>bx? r.x: bx;
+	int y0 = r.y>by? r.y: by;
+	int x1 = r.right()<bx+m_blockSize? r.right(): bx+m_blockSize;
+	int y1 = r.bottom()<by+m_blockSize? r.bottom(): by+m_blockSize;
+	size_t len = (x1-x0) * m_bytes;
+	for(int y=y0; y<y1; ++y) {
+		char*  d = data + ((size_t)(y-r.y)*r.width + (x0-r.x)) * m_bytes;
+		ubyte* b = block + ((size_t)(y-by)*m_blockSize + (x0-bx)) * m_bytes;
+		if(write) memcpy(b, d, len);
+		else memcpy(d, b, len);
+	}
 }
 
 int BufferedStream::getPixel(int x, int y, void* pixel) {
-	if(m_bufferRect.contains(x, y)) {
-		memcpy(pixel, m_buffer + getBufferAddress(x,y), m_bytes);
-		return m_bytes;
-	} else return m_stream->getPixel(x, y, pixel);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Point index(blockIndex(x, m_blockSize), blockIndex(y, m_blockSize));
+	Block* block = findBlock(index);
+	if(!block) {
+		++m_info.misses;
+		return m_stream->getPixel(x, y, pixel);
+	}
+	++m_info.hits;
+	size_t addr = ((size_t)(y-index.y*m_blockSize)*m_blockSize + (x-index.x*m_blockSize)) * m_bytes;
+	memcpy(pixel, block->data + addr, m_bytes);
+	return m_bytes;
 }
 
 int BufferedStream::setPixel(int x, int y, void* pixel) {
-	if(!m_bufferRect.contains(x, y)) fillBuffer(x-m_bufferRect.width/2, y-m_bufferRect.height/2);
-	memcpy(m_buffer + getBufferAddress(x, y), pixel, m_bytes);
-	m_changed = true;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Point index(blockIndex(x, m_blockSize), blockIndex(y, m_blockSize));
+	Block& block = getBlock(index);
+	size_t addr = ((size_t)(y-index.y*m_blockSize)*m_blockSize + (x-index.x*m_blockSize)) * m_bytes;
+	memcpy(block.data + addr, pixel, m_bytes);
+	block.dirty = true;
 	return 1;
 }
 
 
 int BufferedStream::getPixels(const Rect& r, void* data) {
-	if(m_bufferRect.contains( r )) {
-		// Read fully from buffer
-		for(int i=0; i<r.height; ++i) {
-			memcpy(((char*)data) + i*r.width*m_bytes, m_buffer + getBufferAddress(r.x,r.y+i), r.width*m_bytes);
-		}
-		return r.width * r.height;
-	} else if(m_bufferRect.intersects( r )) {
-		// Read partially from buffer
-		size_t count = m_stream->readBlock(r.x, r.y, r.width, r.height, data);
-		int off = r.x<m_bufferRect.x? m_bufferRect.x-r.x: 0;
-		int len = r.x+r.width>m_bufferRect.right()? m_bufferRect.right()-r.x-off: r.width-off;
-		int y0 = r.y<m_bufferRect.y? m_bufferRect.y-r.y: 0;
-		int y1 = r.y+r.height>m_bufferRect.bottom()? m_bufferRect.bottom()-r.y: r.height;
-		for(int i=y0; i<y1; ++i) {
-			memcpy(((char*)data) + (i*r.width+off)*m_bytes, m_buffer + getBufferAddress(r.x+off,r.y+i), len*m_bytes);
+	if(r.width<=0 || r.height<=0) return 0;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Point a(blockIndex(r.x, m_blockSize), blockIndex(r.y, m_blockSize));
+	Point b(blockIndex(r.right()-1, m_blockSize), blockIndex(r.bottom()-1, m_blockSize));
+
+	// Reads do not fill the cache. Read from file unless all blocks are cached
+	bool cached = true;
+	for(Point p(a.x, a.y); cached && p.y<=b.y; ++p.y) {
+		for(p.x=a.x; cached && p.x<=b.x; ++p.x) cached = m_blocks.find(p) != m_blocks.end();
+	}
+	int count = r.width * r.height;
+	if(cached) ++m_info.hits;
+	else {
+		++m_info.misses;
+		count = m_stream->readBlock(r.x, r.y, r.width, r.height, data);
+	}
+
+	// Copy cached data over file data
+	if(m_blocks.empty()) return count;
+	for(Point p(a.x, a.y); p.y<=b.y; ++p.y) {
+		for(p.x=a.x; p.x<=b.x; ++p.x) {
+			if(Block* block = findBlock(p)) copyBlock(r, (char*)data, p, block->data, false);
 		}
-		return count;
-	} else {	// Read fully from file
-		return m_stream->readBlock(r.x, r.y, r.width, r.height, data);
 	}
+	return count;
 }
+
 int BufferedStream::setPixels(const Rect& r, void* data) {
-	if(!m_bufferRect.contains(r)) {
-		fillBuffer(r.x+r.width/2-m_bufferRect.width/2, r.y+r.height/2-m_bufferRect.height/2);
-	}
-	for(int i=0; i<r.height; ++i) {
-		memcpy(m_buffer + getBufferAddress(r.x, r.y+i), ((char*)data) + i*r.width*m_bytes, r.width*m_bytes);
+	if(r.width<=0 || r.height<=0) return 0;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Point a(blockIndex(r.x, m_blockSize), blockIndex(r.y, m_blockSize));
+	Point b(blockIndex(r.right()-1, m_blockSize), blockIndex(r.bottom()-1, m_blockSize));
+	for(Point p(a.x, a.y); p.y<=b.y; ++p.y) {
+		for(p.x=a.x; p.x<=b.x; ++p.x) {
+			// Blocks fully covered by the rect don't need reading
+			int bx = p.x * m_blockSize, by = p.y * m_blockSize;
+			bool covered = r.x<=bx && r.y<=by && r.right()>=bx+m_blockSize && r.bottom()>=by+m_blockSize;
+			Block& block = getBlock(p, !covered);
+			copyBlock(r, (char*)data, p, block.data, true);
+			block.dirty = true;
+		}
 	}
-	m_changed = true;
 	return r.width * r.height;
 }
 
+int BufferedStream::getSamples(int x, int y, int step, int columns, int rows, void* data) {
+	if(step == 1) {
+		memset(data, 0, (size_t)columns * rows * m_bytes);
+		return getPixels(Rect(x, y, columns, rows), data);
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// File reads sparse samples from an overview level where possible. Cached blocks may have newer data
+	m_stream->readSamples(x, y, step, columns, rows, data);
+	ubyte* out = (ubyte*)data;
+	bool hit = true;
+	for(int j=0; j<rows; ++j) {
+		int py = y + j * step;
+		for(int i=0; i<columns; ++i, out+=m_bytes) {
+			int px = x + i * step;
+			if(px<0 || py<0 || px>=width() || py>=height()) continue;
+			Point index(px / m_blockSize, py / m_blockSize);
+			std::map<Point, Block>::iterator it = m_blocks.find(index);
+			if(it == m_blocks.end()) hit = false;
+			else memcpy(out, it->second.data + ((size_t)(py-index.y*m_blockSize)*m_blockSize + (px-index.x*m_blockSize)) * m_bytes, m_bytes);
+		}
+	}
+	if(hit) ++m_info.hits;
+	else ++m_info.misses;
+	return columns * rows;
+}
+
 // =========================================================================== //
 
 
+bool BufferedStream::buildOverviews() {
+	if(!m_stream) return false;
+	if(m_stream->overviewCount()) return true;
+	flush();
+	printf("Generating overviews\n");
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stream->buildOverviews();
+}
+
 int BufferedStream::flush() {
-	if(!m_changed) return 0;
 	if(!m_stream) return 0;
-	m_changed = false;
-	return m_stream->writeBlock(m_bufferRect.x, m_bufferRect.y, m_bufferRect.width, m_bufferRect.height, m_buffer);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int count = 0;
+	for(std::map<Point, Block>::iterator i=m_blocks.begin(); i!=m_blocks.end(); ++i) {
+		if(i->second.dirty) count += writeBlock(i->first, i->second);
+	}
+	// Blocks written on eviction still need syncing, overview updates and recompression
+	m_stream->flush();
+	return count;
 }
-int BufferedStream::fillBuffer(int x, int y) {
-	flush();
-	m_bufferRect.x = x;
-	m_bufferRect.y = y;
-	int byteCount = m_bufferRect.width * m_bufferRect.height * m_bytes;
-	if(!m_buffer) m_buffer = new ubyte[ byteCount ];
-	memset(m_buffer, 0, byteCount);
-	return m_stream->readBlock(m_bufferRect.x, m_bufferRect.y, m_bufferRect.width, m_bufferRect.height, m_buffer);
+
+// =========================================================================== //
+
+int BufferedStream::prefetch(const Rect& r) {
+	if(!m_stream || r.width<=0 || r.height<=0) return 0;
+	// Clip to image
+	int x0 = r.x<0? 0: r.x, y0 = r.y<0? 0: r.y;
+	int x1 = r.right()>width()? width(): r.right();
+	int y1 = r.bottom()>height()? height(): r.bottom();
+	if(x0>=x1 || y0>=y1) return 0;
+
+	// Never load more than half the cache so a request can't evict itself
+	int limit = m_cacheLimit / blockBytes() / 2;
+	int count = 0;
+	for(Point p(x0/m_blockSize, y0/m_blockSize); p.y<=(y1-1)/m_blockSize; ++p.y) {
+		for(p.x=x0/m_blockSize; p.x<=(x1-1)/m_blockSize && count<limit; ++p.x) {
+			// Lock per block so other threads are not stalled for long
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if(m_blocks.find(p) != m_blocks.end()) continue;
+			getBlock(p);
+			++m_info.prefetched;
+			++count;
+		}
+	}
+	return count;
+}
+
+void BufferedStream::requestPrefetch(const Rect* rects, int count) {
+	std::lock_guard<std::mutex> lock(m_prefetchMutex);
+	m_prefetchRects.assign(rects, rects + count);
+	m_prefetchSignal.notify_one();
+}
+
+void BufferedStream::startPrefetchThread() {
+	std::lock_guard<std::mutex> lock(m_prefetchMutex);
+	if(m_prefetchRunning) return;
+	m_prefetchRunning = true;
+	m_prefetchThread.begin(this, &BufferedStream::prefetchThread);
+}
+
+void BufferedStream::stopPrefetchThread() {
+	{
+		std::lock_guard<std::mutex> lock(m_prefetchMutex);
+		m_prefetchRunning = false;
+		m_prefetchRects.clear();
+		m_prefetchSignal.notify_one();
+	}
+	while(m_prefetchThread.running()) std::this_thread::yield();
+}
+
+void BufferedStream::prefetchThread() {
+	std::vector<Rect> rects;
+	std::unique_lock<std::mutex> lock(m_prefetchMutex);
+	while(m_prefetchRunning) {
+		if(m_prefetchRects.empty()) m_prefetchSignal.wait(lock);
+		rects.swap(m_prefetchRects);
+		m_prefetchRects.clear();
+		lock.unlock();
+		for(size_t i=0; i<rects.size(); ++i) prefetch(rects[i]);
+		lock.lock();
+	}
+}
+
+BufferedStream::CacheInfo BufferedStream::getCacheInfo() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	CacheInfo info = m_info;
+	info.blocks = m_blocks.size();
+	info.bytes = m_cacheSize;
+	return info;
+}
+
+void BufferedStream::resetCacheInfo() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_info.hits = m_info.misses = m_info.prefetched = 0;
+	m_info.blocks = m_info.bytes = 0;
 }
 
 
@@ -137,22 +342,84 @@ int BufferedStream::fillBuffer(int x, int y) {
 
 
 
-StreamUndo::StreamUndo(BufferedStream* source, int s) : m_source(source), m_blockSize(s) {}
+std::list<StreamUndo*> StreamUndo::s_steps;
+size_t StreamUndo::s_memory = 0;
+size_t StreamUndo::s_limit = 64<<20;
+FILE*  StreamUndo::s_file = 0;
+int    StreamUndo::s_count = 0;
+
+// Delta format: repeated [zero run][literal count][literal bytes], counts as 7 bit varints
+static void writeCount(std::vector<char>& out, size_t n) {
+	while(n >= 0x80) out.push_back((char)(n | 0x80)), n >>= 7;
+	out.push_back((char)n);
+}
+static size_t readCount(const char*& s) {
+	size_t n = 0;
+	for(int shift=0; ; shift+=7) {
+		ubyte c = *s++;
+		n |= (size_t)(c & 0x7f) << shift;
+		if(c < 0x80) return n;
+	}
+}
+static void packDelta(const ubyte* d, size_t n, std::vector<char>& out) {
+	size_t i = 0;
+	while(i < n) {
+		size_t zeros = i;
+		while(i<n && d[i]==0) ++i;
+		zeros = i - zeros;
+		// Literals end at a run of 4 zeros
+		size_t start = i;
+		while(i<n && (d[i] || (i+4<=n && (d[i+1] || d[i+2] || d[i+3])))) ++i;
+		writeCount(out, zeros);
+		writeCount(out, i - start);
+		out.insert(out.end(), d + start, d + i);
+	}
+}
+static const char* applyDelta(const char* s, ubyte* d, size_t n) {
+	for(size_t i=0; i<n; ) {
+		i += readCount(s);
+		size_t count = readCount(s);
+		for(size_t j=0; j<count; ++j) d[i++] ^= *s++;
+	}
+	return s;
+}
+
+
+StreamUndo::StreamUndo(BufferedStream* source, int s) : m_source(source), m_blockSize(s), m_size(0), m_fileOffset(-1) {
+	++s_count;
+}
 StreamUndo::~StreamUndo() {
-	for(std::map<Point, char*>::iterator i=m_data.begin(); i!=m_data.end(); ++i) delete i->second;
+	for(std::map<Point, char*>::iterator i=m_data.begin(); i!=m_data.end(); ++i) delete [] i->second;
+	if(m_fileOffset<0) {
+		s_steps.remove(this);
+		s_memory -= m_size;
+	}
+	if(--s_count==0 && s_file) {
+		fclose(s_file);
+		s_file = 0;
+	}
 }
 const char* StreamUndo::getName() const {
 	return "Stream edit";
 }
+size_t StreamUndo::getSize() const {
+	return m_size;
+}
+void StreamUndo::setMemoryLimit(size_t bytes) {
+	s_limit = bytes;
+	checkMemory();
+}
+
 void StreamUndo::addRect(const Rect& r) {
-	int x0 = r.x / m_blockSize;
-	int y0 = r.y / m_blockSize;
-	int x1 = r.right() / m_blockSize;
-	int y1 = r.bottom() / m_blockSize;
+	// Only pixels inside the image
+	int x0 = blockIndex(std::max(r.x, 0), m_blockSize);
+	int y0 = blockIndex(std::max(r.y, 0), m_blockSize);
+	int x1 = blockIndex(std::min(r.right(), m_source->width()) - 1, m_blockSize);
+	int y1 = blockIndex(std::min(r.bottom(), m_source->height()) - 1, m_blockSize);
 	Rect block(0, 0, m_blockSize, m_blockSize);
 
-	for(Point p(x0, y0); p.y<y1; ++p.y) {
-		for(p.x = x0; p.x<x1; ++p.x) {
+	for(Point p(x0, y0); p.y<=y1; ++p.y) {
+		for(p.x = x0; p.x<=x1; ++p.x) {
 			if(m_data.find(p)==m_data.end()) {
 				char* data = new char[ m_blockSize * m_blockSize * m_source->pixelSize() ];
 				block.x = p.x * m_blockSize;
@@ -164,13 +431,81 @@ void StreamUndo::addRect(const Rect& r) {
 	}
 }
 
-void StreamUndo::execute() {
+void StreamUndo::finish() {
+	if(m_data.empty() || !load()) return;
+	// Store difference between the saved and current pixels. Unchanged blocks are dropped
+	size_t bytes = (size_t)m_blockSize * m_blockSize * m_source->pixelSize();
+	ubyte* data = new ubyte[bytes];
 	Rect r(0, 0, m_blockSize, m_blockSize);
 	for(std::map<Point, char*>::iterator i=m_data.begin(); i!=m_data.end(); ++i) {
 		r.x = i->first.x * m_blockSize;
 		r.y = i->first.y * m_blockSize;
-		m_source->setPixels(r, i->second);
+		m_source->getPixels(r, data);
+		bool changed = false;
+		for(size_t j=0; j<bytes; ++j) changed |= (data[j] ^= i->second[j]) != 0;
+		if(changed) {
+			Entry e = { i->first, m_packed.size() };
+			m_blocks.push_back(e);
+			packDelta(data, bytes, m_packed);
+		}
+		delete [] i->second;
+	}
+	delete [] data;
+	m_data.clear();
+
+	s_steps.remove(this);
+	s_memory -= m_size;
+	m_size = m_packed.size();
+	if(m_size) {
+		s_steps.push_back(this);
+		s_memory += m_size;
+		checkMemory();
+	}
+}
+
+void StreamUndo::checkMemory() {
+	// Move the oldest steps to a temp file
+	while(s_memory > s_limit && !s_steps.empty()) {
+		StreamUndo* step = s_steps.front();
+		s_steps.pop_front();
+		if(!s_file) s_file = tmpfile();
+		if(!s_file) return;
+		fseek(s_file, 0, SEEK_END);
+		step->m_fileOffset = ftell(s_file);
+		fwrite(&step->m_packed[0], 1, step->m_size, s_file);
+		std::vector<char>().swap(step->m_packed);
+		s_memory -= step->m_size;
+	}
+}
+
+bool StreamUndo::load() {
+	if(m_fileOffset < 0) return true;
+	m_packed.resize(m_size);
+	fseek(s_file, m_fileOffset, SEEK_SET);
+	if(fread(&m_packed[0], 1, m_size, s_file) != m_size) return printf("ERROR: Failed to read undo data\n"), false;
+	m_fileOffset = -1;
+	s_steps.push_back(this);
+	s_memory += m_size;
+	return true;
+}
+
+void StreamUndo::execute() {
+	finish();
+	if(m_blocks.empty() || !load()) return;
+	const char* packed = &m_packed[0];
+	// Applying the deltas swaps between the edited and original pixels
+	size_t bytes = (size_t)m_blockSize * m_blockSize * m_source->pixelSize();
+	ubyte* data = new ubyte[bytes];
+	Rect r(0, 0, m_blockSize, m_blockSize);
+	for(size_t i=0; i<m_blocks.size(); ++i) {
+		r.x = m_blocks[i].index.x * m_blockSize;
+		r.y = m_blocks[i].index.y * m_blockSize;
+		m_source->getPixels(r, data);
+		applyDelta(packed + m_blocks[i].offset, data, bytes);
+		m_source->setPixels(r, data);
 	}
+	delete [] data;
+	checkMemory();
 }
 
 
@@ -2,21 +2,28 @@
 #define _BUFFERED_STREAM_
 
 #include <base/math.h>
+#include <base/thread.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
 #include <list>
 #include <map>
 #include <cstdlib>
+#include <cstdio>
 
 class TiffStream;
 
-/** Streamed tiff file with write buffering */
+/** Streamed tiff file with write buffering.
+ *  Edited pixels are held in a cache of square blocks which are written back when evicted or flushed */
 class BufferedStream {
 	public:
-	BufferedStream(int bufferSize=128);
+	BufferedStream(int blockSize=64);
 	virtual ~BufferedStream();
 
 	bool openStream(const char* file);
-	bool createStream(const char* file, int width, int height, int channels, int bitsPerChannel=8, void* init=0);
-	void setBufferSize(int width, int height);
+	bool createStream(const char* file, int width, int height, int channels, int bitsPerChannel=8, void* init=0, int tileSize=0);
+	void setBlockSize(int size);		// Flushes cache
+	void setCacheSize(size_t bytes);	// Memory limit for cached blocks
 	virtual void closeStream();
 
 	int width() const;
@@ -28,35 +35,94 @@ class BufferedStream {
 	virtual int setPixel(int x, int y, void* pixel);
 	virtual int getPixels(const Rect& rect, void* data);
 	virtual int setPixels(const Rect& rect, void* data);
-	virtual int fillBuffer(int x, int y);
 	virtual int flush();
 
+	/** Append reduced resolution overviews to the file if it has none. Files are opened without adding them */
+	bool buildOverviews();
+
+	/** Read a grid of pixels spaced step apart, using file overviews where possible. Samples outside the image are zero */
+	int getSamples(int x, int y, int step, int columns, int rows, void* data);
+
+	/** Load blocks overlapping a rect into the cache. Returns number of blocks loaded */
+	int  prefetch(const Rect& rect);
+	/** Queue rects to be prefetched by the background thread. Replaces any pending request */
+	void requestPrefetch(const Rect* rects, int count);
+	void startPrefetchThread();
+	void stopPrefetchThread();
+
+	/** Cache statistics. Reads fully served from cached blocks count as hits */
+	struct CacheInfo { size_t hits, misses, prefetched, blocks, bytes; };
+	CacheInfo getCacheInfo() const;
+	void      resetCacheInfo();
+
 	protected:
+	struct Block {
+		ubyte* data;
+		bool   dirty;
+		std::list<Point>::iterator lru;
+	};
+
 	TiffStream* m_stream;
-	ubyte*      m_buffer;
-	Rect        m_bufferRect;
-	int         m_bytes;	// bytes per pixel
-	bool        m_changed;
+	int         m_bytes;		// bytes per pixel
+	int         m_blockSize;	// Width and height of cache blocks
+	size_t      m_cacheSize;	// Memory used by cached blocks
+	size_t      m_cacheLimit;	// Maximum memory for cached blocks
+	std::map<Point, Block> m_blocks;	// Cached blocks by block index
+	std::list<Point>       m_lru;		// Block indices, most recently used first
+	mutable std::mutex     m_mutex;		// Guards cache and stream access
+	CacheInfo              m_info;
 
-	size_t getBufferAddress(int x, int y) const;
+	base::Thread            m_prefetchThread;
+	std::mutex              m_prefetchMutex;
+	std::condition_variable m_prefetchSignal;
+	std::vector<Rect>       m_prefetchRects;	// Pending prefetch request
+	bool                    m_prefetchRunning;
+	void prefetchThread();
+
+	Block* findBlock(const Point& index);	// Get a cached block, or null
+	Block& getBlock(const Point& index, bool read=true);	// Get a block, loading it if needed
+	int    writeBlock(const Point& index, Block& block);
+	void   evictBlock();
+	void   clearCache();
+	void   copyBlock(const Rect& r, char* data, const Point& index, ubyte* block, bool write) const;
+	size_t blockBytes() const { return (size_t)m_blockSize * m_blockSize * m_bytes; }
 	virtual void streamOpened() {}
 };
 
 
 #include "terraineditor/undo.h"
 
-/** Undo action for streamed editing */
+/** Undo action for streamed editing. Call addRect before changing pixels, and finish afterwards.
+ *  Changed blocks are kept as run length encoded xor deltas, so execute toggles between undo and redo.
+ *  When all steps use more than the memory limit, the oldest are moved to a temp file */
 class StreamUndo : public UndoCommand {
 	public:
 	StreamUndo(BufferedStream* source, int blockSize=16);
 	~StreamUndo();
 	virtual const char* getName() const;
-	virtual void execute();
-	void addRect(const Rect& r);
+	virtual void execute();			// Undo the edit, or redo it if undone
+	void addRect(const Rect& r);	// Save pixels about to be changed
+	void finish();					// Pack changes. Called by execute if needed
+	size_t getSize() const;			// Packed size in bytes
+
+	static void setMemoryLimit(size_t bytes);	// Default 64mb
+
 	protected:
-	BufferedStream* m_source;
-	int             m_blockSize;
-	std::map<Point, char*> m_data;
+	struct Entry { Point index; size_t offset; };
+	BufferedStream*        m_source;
+	int                    m_blockSize;
+	std::map<Point, char*> m_data;		// Pre-edit pixels until finished
+	std::vector<Entry>     m_blocks;	// Changed blocks in map order. Only ever walked in order, so no lookup table
+	std::vector<char>      m_packed;	// Packed deltas
+	size_t                 m_size;		// Packed size
+	long                   m_fileOffset;// Location in temp file if moved out of memory
+
+	bool load();
+	static void checkMemory();
+	static std::list<StreamUndo*> s_steps;	// Packed steps in memory, oldest first
+	static size_t s_memory, s_limit;
+	static FILE*  s_file;
+	static int    s_count;
 };
 
 
@@ -0,0 +1,252 @@
+#include "heighttree.h"
+#include "landscape.h"
+#include <base/collision.h>
+#include <algorithm>
+
+HeightTree::HeightTree(const Landscape* land, const vec3& origin, float size, float step)
+	: m_landscape(land), m_origin(origin), m_step(step), m_used(0)
+{
+	m_samples = (int)(size / step + 0.5f) + 1;
+	int blocks = (m_samples - 2) / BLOCK + 1;
+	m_blocks = 1;
+	m_levels = 1;
+	while(m_blocks < blocks) m_blocks <<= 1, ++m_levels;
+
+	// Block ranges are unknown until first used. Padding blocks are empty
+	const Node unknown = { -INFINITY, INFINITY };
+	const Node empty = { INFINITY, -INFINITY };
+	m_nodes.resize(m_levels);
+	for(int i=0; i<m_levels; ++i) m_nodes[i].assign((m_blocks>>i) * (m_blocks>>i), unknown);
+	for(int y=0; y<m_blocks; ++y) for(int x=0; x<m_blocks; ++x) {
+		if(x>=blocks || y>=blocks) m_nodes[0][x + y*m_blocks] = empty;
+	}
+	for(int level=1; level<m_levels; ++level) {
+		for(int y=0; y<m_blocks>>level; ++y) for(int x=0; x<m_blocks>>level; ++x) updateNode(level, x, y);
+	}
+	m_cache.reserve(CACHE);
+}
+
+void HeightTree::build() {
+	// Read a row of blocks at a time
+	int blocks = (m_samples - 2) / BLOCK + 1;
+	std::vector<float> heights(m_samples * (BLOCK + 1));
+	for(int by=0; by<blocks; ++by) {
+		Rect r(0, by*BLOCK, m_samples, std::min((int)BLOCK, m_samples - 1 - by*BLOCK) + 1);
+		m_landscape->fillHeights(m_origin, m_step, r, &heights[0]);
+		for(int bx=0; bx<blocks; ++bx) {
+			Node& node = m_nodes[0][bx + by*m_blocks];
+			int x0 = bx * BLOCK;
+			int x1 = std::min(x0 + BLOCK, m_samples - 1);
+			node.min = INFINITY;
+			node.max = -INFINITY;
+			for(int y=0; y<r.height; ++y) {
+				const float* h = &heights[y * m_samples];
+				for(int x=x0; x<=x1; ++x) {
+					node.min = std::min(node.min, h[x]);
+					node.max = std::max(node.max, h[x]);
+				}
+			}
+		}
+	}
+	for(int level=1; level<m_levels; ++level) {
+		for(int y=0; y<m_blocks>>level; ++y) for(int x=0; x<m_blocks>>level; ++x) updateNode(level, x, y);
+	}
+}
+
+void HeightTree::updateNode(int level, int x, int y) const {
+	int w = m_blocks >> level;
+	const Node* c = &m_nodes[level-1][x*2 + y*4*w];
+	const Node* n[4] = { c, c+1, c+w*2, c+w*2+1 };
+	Node& node = m_nodes[level][x + y*w];
+	node.min = INFINITY;
+	node.max = -INFINITY;
+	for(int i=0; i<4; ++i) {
+		if(n[i]->unknown()) { node = *n[i]; break; }
+		node.min = std::min(node.min, n[i]->min);
+		node.max = std::max(node.max, n[i]->max);
+	}
+}
+
+void HeightTree::updateParents(int x, int y) const {
+	for(int level=1; level<m_levels; ++level) updateNode(level, x>>=1, y>>=1);
+}
+
+const float* HeightTree::getBlock(int x, int y) const {
+	int index = x + y * m_blocks;
+	Block* block = 0;
+	for(size_t i=0; i<m_cache.size(); ++i) {
+		if(m_cache[i].index == index) {
+			m_cache[i].used = ++m_used;
+			return &m_cache[i].heights[0];
+		}
+		if(!block || m_cache[i].used < block->used) block = &m_cache[i];
+	}
+	if(m_cache.size() < (size_t)CACHE) {
+		m_cache.push_back(Block());
+		block = &m_cache.back();
+	}
+
+	// Fetch block heights including the shared edge samples
+	Rect r(x*BLOCK, y*BLOCK, 0, 0);
+	r.width = std::min((int)BLOCK, m_samples - 1 - r.x) + 1;
+	r.height = std::min((int)BLOCK, m_samples - 1 - r.y) + 1;
+	block->index = index;
+	block->used = ++m_used;
+	block->heights.resize(r.width * r.height);
+	m_landscape->fillHeights(m_origin, m_step, r, &block->heights[0]);
+
+	Node& node = m_nodes[0][index];
+	node.min = node.max = block->heights[0];
+	for(size_t i=1; i<block->heights.size(); ++i) {
+		node.min = std::min(node.min, block->heights[i]);
+		node.max = std::max(node.max, block->heights[i]);
+	}
+	updateParents(x, y);
+	return &block->heights[0];
+}
+
+void HeightTree::update(const BoundingBox& box) {
+	// Samples on a block edge belong to both blocks
+	int x0 = std::max(0, (int)floor((box.min.x - m_origin.x) / m_step) - 1) / BLOCK;
+	int y0 = std::max(0, (int)floor((box.min.z - m_origin.z) / m_step) - 1) / BLOCK;
+	int x1 = (int)ceil((box.max.x - m_origin.x) / m_step) / BLOCK;
+	int y1 = (int)ceil((box.max.z - m_origin.z) / m_step) / BLOCK;
+	int last = (m_samples - 2) / BLOCK;
+	x1 = std::min(x1, last);
+	y1 = std::min(y1, last);
+	for(int y=y0; y<=y1; ++y) for(int x=x0; x<=x1; ++x) {
+		int index = x + y * m_blocks;
+		for(size_t i=0; i<m_cache.size(); ++i) if(m_cache[i].index == index) m_cache[i].index = -1;
+		getBlock(x, y);
+	}
+}
+
+bool HeightTree::clip(const Trace& r, int level, int x, int y, float& t0, float& t1) const {
+	// Clip ray to node area. Slightly enlarged so rays along an edge still reach its cells
+	const float size = m_step * (BLOCK << level);
+	const float margin = m_step * 1e-3f;
+	const float lo[2] = { m_origin.x + x*size - margin, m_origin.z + y*size - margin };
+	const float p[2] = { r.start.x, r.start.z };
+	const float d[2] = { r.direction.x, r.direction.z };
+	for(int i=0; i<2; ++i) {
+		float hi = lo[i] + size + margin * 2;
+		if(d[i] == 0) {
+			if(p[i] < lo[i] || p[i] > hi) return false;
+			continue;
+		}
+		float a = (lo[i] - p[i]) / d[i];
+		float b = (hi - p[i]) / d[i];
+		if(a > b) std::swap(a, b);
+		if(a > t0) t0 = a;
+		if(b < t1) t1 = b;
+	}
+	if(t0 > t1) return false;
+
+	// Height range test
+	const Node& node = m_nodes[level][x + y * (m_blocks >> level)];
+	float y0 = r.start.y + r.direction.y * t0;
+	float y1 = r.start.y + r.direction.y * t1;
+	return std::min(y0, y1) <= node.max && std::max(y0, y1) >= node.min;
+}
+
+bool HeightTree::traverse(Trace& r, int level, int x, int y, float t0, float t1) const {
+	if(!clip(r, level, x, y, t0, t1)) return false;
+	if(level == 0) {
+		// Fetch unknown blocks the ray reaches to get their range
+		if(m_nodes[0][x + y*m_blocks].unknown()) {
+			getBlock(x, y);
+			if(!clip(r, 0, x, y, t0, t1)) return false;
+		}
+		return traceBlock(r, x, y, t0, t1);
+	}
+
+	// Children front to back. Ray intervals of children are disjoint so the first hit is the nearest
+	int fx = r.direction.x < 0;
+	int fz = r.direction.z < 0;
+	for(int i=0; i<4; ++i) {
+		int cx = x*2 + ((i&1) ^ fx);
+		int cz = y*2 + ((i>>1) ^ fz);
+		if(traverse(r, level-1, cx, cz, t0, t1)) return true;
+	}
+	return false;
+}
+
+bool HeightTree::traceBlock(Trace& r, int bx, int by, float t0, float t1) const {
+	const float* heights = getBlock(bx, by);
+	const int cellsX = std::min((int)BLOCK, m_samples - 1 - bx*BLOCK);
+	const int cellsZ = std::min((int)BLOCK, m_samples - 1 - by*BLOCK);
+	const int pitch = cellsX + 1;
+	const float ox = m_origin.x + bx * BLOCK * m_step;
+	const float oz = m_origin.z + by * BLOCK * m_step;
+
+	// Walk cells along the ray
+	vec3 p = r.start + r.direction * t0;
+	int x = std::max(0, std::min(cellsX-1, (int)floor((p.x - ox) / m_step)));
+	int z = std::max(0, std::min(cellsZ-1, (int)floor((p.z - oz) / m_step)));
+	int sx = r.direction.x < 0? -1: 1;
+	int sz = r.direction.z < 0? -1: 1;
+	float tx = r.direction.x != 0? (ox + (x + (sx>0)) * m_step - r.start.x) / r.direction.x: INFINITY;
+	float tz = r.direction.z != 0? (oz + (z + (sz>0)) * m_step - r.start.z) / r.direction.z: INFINITY;
+	float dx = r.direction.x != 0? m_step / fabs(r.direction.x): INFINITY;
+	float dz = r.direction.z != 0? m_step / fabs(r.direction.z): INFINITY;
+
+	while(true) {
+		// Cell triangles match the landscape mesh, split from (x+1,z) to (x,z+1)
+		const float* h = heights + x + z * pitch;
+		vec3 a(ox + x*m_step, h[0], oz + z*m_step);
+		vec3 b(a.x + m_step, h[1], a.z);
+		vec3 c(a.x, h[pitch], a.z + m_step);
+		vec3 d(b.x, h[pitch+1], c.z);
+		float t;
+		bool hit = false;
+		if(base::intersectRayTriangle(r.start, r.direction, a, b, c, t) && t >= 0 && t <= r.t) {
+			r.t = t;
+			r.normal = (c-a).cross(b-a);
+			hit = true;
+		}
+		if(base::intersectRayTriangle(r.start, r.direction, b, d, c, t) && t >= 0 && t <= r.t) {
+			r.t = t;
+			r.normal = (c-b).cross(d-b);
+			hit = true;
+		}
+		if(hit) {
+			r.normal.normalise();
+			return true;
+		}
+
+		if(tx < tz) {
+			if(tx > t1) break;
+			x += sx;
+			tx += dx;
+			if(x < 0 || x >= cellsX) break;
+		}
+		else {
+			if(tz > t1) break;
+			z += sz;
+			tz += dz;
+			if(z < 0 || z >= cellsZ) break;
+		}
+	}
+	return false;
+}
+
+bool HeightTree::intersect(const vec3& start, const vec3& direction, float& t, vec3& normal) const {
+	Trace r;
+	r.start = start;
+	r.direction = direction;
+	r.t = t;
+	if(!traverse(r, m_levels-1, 0, 0, 0, t)) return false;
+	t = r.t;
+	normal = r.normal;
+	return true;
+}
+
+int HeightTree::intersect(int count, const vec3* start, const vec3* direction, float* t, vec3* normal, bool* hit) const {
+	int hits = 0;
+	for(int i=0; i<count; ++i) {
+		hit[i] = intersect(start[i], direction[i], t[i], normal[i]);
+		if(hit[i]) ++hits;
+	}
+	return hits;
+}
+
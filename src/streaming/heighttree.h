@@ -0,0 +1,54 @@
+#pragma once
+
+#include <base/math.h>
+#include <vector>
+
+class Landscape;
+
+/** Min/max height quadtree over the full resolution source heights of a landscape, for exact ray intersection.
+ *  Only block height ranges are stored. Heights are fetched through Landscape::fillHeights when a ray reaches a block,
+ *  and block ranges are filled on first use */
+class HeightTree {
+	public:
+	HeightTree(const Landscape* land, const vec3& origin, float size, float step);
+
+	/** Intersect a ray with the heightfield. t is the maximum distance on input and the hit distance on output */
+	bool intersect(const vec3& start, const vec3& normalisedDirection, float& t, vec3& normal) const;
+
+	/** Intersect a batch of rays. Rays share cached height blocks. Returns the number of hits */
+	int intersect(int count, const vec3* start, const vec3* normalisedDirection, float* t, vec3* normal, bool* hit) const;
+
+	/** Fill all block ranges now. Without this, ranges are unknown until a ray reaches the block,
+	 *  and rays descend through every block they cross until its siblings are known */
+	void build();
+
+	/** Heights changed in an area. Reads the affected blocks again */
+	void update(const BoundingBox& box);
+
+	protected:
+	struct Node { float min, max; bool unknown() const { return min == -INFINITY; } };	// Unknown: [-inf,inf], empty: [inf,-inf]
+	struct Block { int index; uint used; std::vector<float> heights; };
+	struct Trace { vec3 start, direction, normal; float t; };
+
+	bool  traverse(Trace&, int level, int x, int y, float t0, float t1) const;
+	bool  traceBlock(Trace&, int x, int y, float t0, float t1) const;
+	const float* getBlock(int x, int y) const;
+	void  updateNode(int level, int x, int y) const;
+	void  updateParents(int x, int y) const;
+	bool  clip(const Trace&, int level, int x, int y, float& t0, float& t1) const;
+
+	const Landscape* m_landscape;
+	vec3  m_origin;		// Position of sample 0,0
+	float m_step;		// Sample spacing
+	int   m_samples;	// Samples per side
+	int   m_blocks;		// Leaf blocks per side. Power of 2
+	int   m_levels;
+	mutable std::vector< std::vector<Node> > m_nodes;	// Level 0 is leaf blocks
+
+	mutable std::vector<Block> m_cache;	// Recently used block heights
+	mutable uint               m_used;
+
+	enum { BLOCK = 16 };	// Cells per leaf block side
+	enum { CACHE = 64 };	// Cached blocks
+};
+
@@ -1,8 +1,13 @@
 #include "landscape.h"
+#include "patchkernel.h"
+#include "heighttree.h"
 #include <base/camera.h>
 #include <cstring>
 #include <cstdio>
 #include <algorithm>
+#include <new>
+#include <chrono>
+#include <thread>
 
 #include <base/game.h>
 #include <base/input.h>
@@ -14,15 +19,137 @@ using base::Camera;
 float landscapeDefaultHeightFunc(const vec3&) { return 0; }
 
 
-Landscape::Landscape(float size, const vec3& pos): m_position(pos), m_size(size) {
+BlockPool::BlockPool(size_t size, size_t count) : m_blockSize(size), m_slabCount(count), m_live(0) {}
+BlockPool::~BlockPool() {
+	for(size_t i=0; i<m_slabs.size(); ++i) delete [] m_slabs[i];
+}
+
+void BlockPool::setBlockSize(size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(m_live) return;
+	for(size_t i=0; i<m_slabs.size(); ++i) delete [] m_slabs[i];
+	m_slabs.clear();
+	m_free.clear();
+	m_blockSize = bytes;
+}
+
+void* BlockPool::allocate() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(m_free.empty()) {
+		// Blocks are padded to keep them aligned. Large blocks use smaller slabs
+		size_t size = (m_blockSize + 15) & ~15;
+		size_t count = std::max<size_t>(1, std::min(m_slabCount, (1<<20) / size));
+		char* slab = new char[ size * count ];
+		m_slabs.push_back(slab);
+		for(size_t i=count; i>0; --i) m_free.push_back(slab + (i-1) * size);
+	}
+	void* block = m_free.back();
+	m_free.pop_back();
+	++m_live;
+	return block;
+}
+
+void BlockPool::release(void* block) {
+	if(!block) return;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_free.push_back(block);
+	--m_live;
+}
+
+//// //// //// //// //// //// //// //// //// //// //// //// //// //// //// ////
+
+void PatchQueue::place(int i, const Entry& e) {
+	m_heap[i] = e;
+	e.patch->*m_slot = i;
+}
+
+void PatchQueue::up(int i) {
+	Entry e = m_heap[i];
+	while(i > 0) {
+		int parent = (i-1) / 2;
+		if(m_heap[parent].priority >= e.priority) break;
+		place(i, m_heap[parent]);
+		i = parent;
+	}
+	place(i, e);
+}
+
+void PatchQueue::down(int i) {
+	Entry e = m_heap[i];
+	int count = m_heap.size();
+	while(true) {
+		int c = i*2 + 1;
+		if(c >= count) break;
+		if(c+1 < count && m_heap[c+1].priority > m_heap[c].priority) ++c;
+		if(m_heap[c].priority <= e.priority) break;
+		place(i, m_heap[c]);
+		i = c;
+	}
+	place(i, e);
+}
+
+void PatchQueue::set(Patch* p, float priority) {
+	int i = p->*m_slot;
+	if(i < 0) {
+		Entry e = { priority, p };
+		m_heap.push_back(e);
+		up(m_heap.size() - 1);
+	}
+	else {
+		float old = m_heap[i].priority;
+		m_heap[i].priority = priority;
+		if(priority > old) up(i);
+		else if(priority < old) down(i);
+	}
+}
+
+void PatchQueue::remove(Patch* p) {
+	int i = p->*m_slot;
+	if(i < 0) return;
+	p->*m_slot = -1;
+	Entry last = m_heap.back();
+	m_heap.pop_back();
+	if(i == (int)m_heap.size()) return;
+	float old = m_heap[i].priority;
+	place(i, last);
+	if(last.priority > old) up(i);
+	else down(i);
+}
+
+Patch* PatchQueue::pop() {
+	Patch* p = m_heap[0].patch;
+	remove(p);
+	return p;
+}
+
+void PatchQueue::clear() {
+	for(size_t i=0; i<m_heap.size(); ++i) m_heap[i].patch->*m_slot = -1;
+	m_heap.clear();
+}
+
+//// //// //// //// //// //// //// //// //// //// //// //// //// //// //// //// 
+
+
+
+Landscape::Landscape(float size, const vec3& pos)
+	: m_position(pos), m_size(size), m_splitQueue(&Patch::m_splitSlot), m_mergeQueue(&Patch::m_mergeSlot), m_scratchPool(0, 4) {
 	m_func        = &landscapeDefaultHeightFunc;
+	m_blockFunc   = 0;
 	m_min         = 0;
 	m_max         = 32;
 	m_patchLimit  = 1000000;
 	m_patchSize   = 9;
 	m_patchStep   = 3;
 	m_threshold   = 8.f;
+	m_format      = FLOAT_VERTICES;
 	m_root        = 0; //new Patch(this);
+	m_heightTree  = 0;
+	m_running     = false;
+	m_jobCount    = 0;
+	m_budget      = 2000;
+	m_lodChanged  = true;
+	m_splits      = m_merges = 0;
+	m_updateTime  = m_splitTime = 0;
 
 	m_createCallback = 0;
 	m_updateCallback = 0;
@@ -30,19 +157,240 @@ Landscape::Landscape(float size, const vec3& pos): m_position(pos), m_size(size)
 
 
 	m_selected = 0; // Debug
+
+	m_indexCount = (m_patchSize * 2 + 4) * (m_patchSize-1) - 4;
+	m_indexSize  = 2;
+	m_patchPool.setBlockSize( sizeof(Patch) );
+	m_vertexPool.setBlockSize( m_patchSize * m_patchSize * 10 * sizeof(float) );
+	m_scratchPool.setBlockSize( m_patchSize * m_patchSize * 10 * sizeof(float) );
 }
 
 Landscape::~Landscape() {
-	delete m_root;
+	// Discard pending splits
+	{
+		std::lock_guard<std::mutex> lock(m_jobMutex);
+		for(size_t i=0; i<m_jobs.size(); ++i) if(m_jobs[i]->patch) m_jobs[i]->patch->m_job = 0, m_jobs[i]->patch = 0;
+		for(size_t i=0; i<m_finished.size(); ++i) if(m_finished[i]->patch) m_finished[i]->patch->m_job = 0, m_finished[i]->patch = 0;
+	}
+	stopThreads();
+	if(m_root) for(int i=0; i<4; ++i) connect(0, i);
+	if(m_root) destroyTree(m_root);
+	clearIndices();
+	delete m_heightTree;
+}
+
+Patch* Landscape::createPatch(Patch* parent, int index) {
+	void* mem = m_patchPool.allocate();
+	if(parent) return new(mem) Patch(parent, index);
+	else return new(mem) Patch(this);
+}
+
+void Landscape::destroyPatch(Patch* p) {
+	m_splitQueue.remove(p);
+	m_mergeQueue.remove(p);
+	p->~Patch();
+	m_patchPool.release(p);
+}
+
+void Landscape::destroyTree(Patch* p) {
+	if(p->m_split) for(int i=0; i<4; ++i) destroyTree(p->m_child[i]);
+	destroyPatch(p);
+}
+
+void Landscape::getPoolInfo(PoolInfo& patches, PoolInfo& vertices) const {
+	patches.live = m_patchPool.live();
+	patches.pooled = m_patchPool.pooled();
+	vertices.live = m_vertexPool.live();
+	vertices.pooled = m_vertexPool.pooled();
+}
+
+static float benchmarkHeight(const vec3& p) {
+	return 200 * sinf(p.x * 0.0011f) * cosf(p.z * 0.0013f) + 30 * sinf(p.x * 0.013f + p.z * 0.007f) + 4 * sinf(p.x * 0.11f) * sinf(p.z * 0.13f);
+}
+
+void Landscape::benchmark(float mapSize, int frames) {
+	static const uint sizes[] = { 9, 17, 33, 65, 129 };
+	int depth = 0;
+	while((1<<depth) < mapSize) ++depth;
+	printf("Landscape benchmark: %gx%g map, %d frames, one unit resolution\n", mapSize, mapSize, frames);
+	printf("  size  patches   draws  triangles  splits  us/split  Mvertex/s  vertex KB  patch KB  index KB\n");
+	for(uint s=0; s<sizeof(sizes)/sizeof(uint); ++s) {
+		Landscape land(mapSize, vec3(-mapSize/2, 0, -mapSize/2));
+		land.setUpdateBudget(1e6f);
+		land.setPatchSize(sizes[s]);
+		land.setLimits(0, depth - land.m_patchStep);
+		land.setHeightFunction(&benchmarkHeight);
+		base::Camera camera(90, 1.6f, 0.5f, mapSize);
+
+		// Fly a circle over the map
+		double draws = 0, triangles = 0, splitTime = 0;
+		int splits = 0;
+		size_t vertexMemory = 0, patchMemory = 0;
+		for(int frame=0; frame<frames; ++frame) {
+			float a = frame * 6.2831853f / frames;
+			vec3 pos(cosf(a) * mapSize * 0.25f, 0, sinf(a) * mapSize * 0.25f);
+			vec3 ahead(-sinf(a), 0, cosf(a));
+			pos.y = benchmarkHeight(pos) + 40;
+			camera.lookat(pos, pos + ahead * 100 - vec3(0, 20, 0));
+			camera.updateFrustum();
+			land.update(&camera);
+			land.cull(&camera);
+
+			Info info = land.getInfo();
+			draws += info.visiblePatches;
+			triangles += info.triangles;
+			splits += info.splits;
+			splitTime += info.splitTime;
+			vertexMemory = std::max(vertexMemory, land.m_vertexPool.live() * land.m_patchSize * land.m_patchSize * 10 * sizeof(float));
+			patchMemory = std::max(patchMemory, land.m_patchPool.live() * sizeof(Patch));
+		}
+
+		size_t indexMemory = 0;
+		for(size_t i=0; i<land.m_indexArrays.size(); ++i) if(land.m_indexArrays[i]) indexMemory += land.m_indexCount * land.m_indexSize;
+		float perSplit = splits? splitTime / splits: 0;
+		float throughput = perSplit>0? 4 * land.m_patchSize * land.m_patchSize / perSplit: 0;
+		printf("  %4u  %7d  %6.0f  %9.0f  %6d  %8.1f  %9.1f  %9zu  %8zu  %8zu\n", sizes[s], land.getInfo().patches,
+			draws / frames, triangles / frames, splits, perSplit, throughput, vertexMemory>>10, patchMemory>>10, indexMemory>>10);
+	}
+}
+
+void Landscape::setVertexFormat(VertexFormat format) {
+	if(m_root) return;
+	m_format = format;
+	size_t vertexSize = format==COMPACT_VERTICES? sizeof(CompactVertex): 10*sizeof(float);
+	m_vertexPool.setBlockSize( m_patchSize * m_patchSize * vertexSize );
+}
+
+void Landscape::setPatchSize(uint size) {
+	if(m_root) return;
+	uint step = 2;
+	while((1u<<step) + 1 < size) ++step;
+	if((1u<<step) + 1 != size || step > 9) {
+		printf("Error: Invalid landscape patch size %u\n", size);
+		return;
+	}
+	clearIndices();
+	m_patchSize = size;
+	m_patchStep = step;
+	m_indexCount = (m_patchSize * 2 + 4) * (m_patchSize-1) - 4;
+	m_indexSize = m_patchSize * m_patchSize > 0x10000? 4: 2;
+	size_t vertexSize = m_format==COMPACT_VERTICES? sizeof(CompactVertex): 10*sizeof(float);
+	m_vertexPool.setBlockSize( m_patchSize * m_patchSize * vertexSize );
+	m_scratchPool.setBlockSize( m_patchSize * m_patchSize * 10 * sizeof(float) );
+}
+
+void Landscape::setThreads(int count) {
+	stopThreads();
+	if(count <= 0) return;
+	m_running = true;
+	m_threads.resize(count);
+	for(size_t i=0; i<m_threads.size(); ++i) {
+		m_threads[i].begin(this, &Landscape::workerThread);
+	}
+}
+
+void Landscape::setUpdateBudget(float us) {
+	m_budget = us;
+}
+
+void Landscape::stopThreads() {
+	{
+		std::lock_guard<std::mutex> lock(m_jobMutex);
+		m_running = false;
+		m_jobSignal.notify_all();
+	}
+	for(size_t i=0; i<m_threads.size(); ++i) {
+		while(m_threads[i].running()) std::this_thread::yield();
+	}
+	m_threads.clear();
+	// Queued jobs are generated here instead
+	for(size_t i=0; i<m_jobs.size(); ++i) {
+		SplitJob* job = m_jobs[i];
+		if(job->patch) for(int j=0; j<4; ++j) job->child[j]->create();
+		m_finished.push_back(job);
+	}
+	m_jobs.clear();
+	attachFinished();
+}
+
+void Landscape::workerThread() {
+	std::unique_lock<std::mutex> lock(m_jobMutex);
+	while(m_running) {
+		if(m_jobs.empty()) {
+			m_jobSignal.wait(lock);
+			continue;
+		}
+		SplitJob* job = m_jobs.front();
+		m_jobs.erase(m_jobs.begin());
+		if(job->patch) {
+			lock.unlock();
+			for(int i=0; i<4; ++i) job->child[i]->create();
+			lock.lock();
+		}
+		m_finished.push_back(job);
+	}
+}
+
+void Landscape::queueSplit(Patch* p) {
+	if(p->m_split || p->m_job) return;
+	SplitJob* job = new SplitJob;
+	job->patch = p;
+	for(int i=0; i<4; ++i) job->child[i] = createPatch(p, i);
+	p->m_job = job;
+	++m_jobCount;
+	std::lock_guard<std::mutex> lock(m_jobMutex);
+	m_jobs.push_back(job);
+	m_jobSignal.notify_one();
+}
+
+void Landscape::cancelSplit(Patch* p) {
+	std::lock_guard<std::mutex> lock(m_jobMutex);
+	p->m_job->patch = 0;
+	p->m_job = 0;
 }
 
-void Landscape::setHeightFunction( HeightFunc func) {
+void Landscape::attachFinished() {
+	std::vector<SplitJob*> finished;
+	{
+		std::lock_guard<std::mutex> lock(m_jobMutex);
+		finished.swap(m_finished);
+	}
+	for(size_t i=0; i<finished.size(); ++i) {
+		SplitJob* job = finished[i];
+		if(job->patch) {
+			job->patch->m_job = 0;
+			job->patch->attach(job->child);
+		}
+		else for(int j=0; j<4; ++j) destroyPatch(job->child[j]);
+		--m_jobCount;
+		delete job;
+	}
+}
+
+void Landscape::setHeightFunction( HeightFunc func, HeightBlockFunc block) {
 	m_func = func;
+	m_blockFunc = block;
 	// Create root here as it needs to be called AFTER HeightFunc is set
 	if(!m_root) {
-		m_root = new Patch(this);
+		m_root = createPatch(0, 0);
 		m_root->create();
 		m_root->build();
+		addLeaf(m_root);
+	}
+}
+
+void Landscape::fillHeights(const vec3& origin, float step, const Rect& r, float* out) const {
+	if(m_blockFunc) {
+		m_blockFunc(origin, step, r, out);
+		return;
+	}
+	vec3 p;
+	for(int y=0; y<r.height; ++y) {
+		p.z = origin.z + (r.y + y) * step;
+		for(int x=0; x<r.width; ++x) {
+			p.x = origin.x + (r.x + x) * step;
+			*out++ = m_func(p);
+		}
 	}
 }
 
@@ -56,54 +404,179 @@ void Landscape::setLimits(int min, int max, int count) {
 	m_min = min;
 	m_max = max;
 	m_patchLimit = count;
+	m_lodChanged = true;
 }
 
 void Landscape::setThreshold(float v) {
 	m_threshold = v;
+	m_lodChanged = true;
 }
 
 void Landscape::connect(Landscape* land, int side) {
-	if(land) m_root->setAdjacent(land->m_root, side);
-	else m_root->clearAdjacent(side);
+	if(!m_root) return;
+	int opp = side ^ 1;
+	if(Patch* adjacent = m_root->m_adjacent[side]) {
+		m_root->clearAdjacent(side);
+		m_root->flagChanged(side);
+		adjacent->flagChanged(opp);
+	}
+	if(!land || !land->m_root) return;
+	if(land->m_size != m_size || land->m_patchSize != m_patchSize) {
+		printf("Error: Connected landscapes must have the same size and patch size\n");
+		return;
+	}
+	if(land->m_root->m_adjacent[opp]) land->connect(0, opp);
+	m_root->setAdjacent(land->m_root, side);
+	m_root->flagChanged(side);
+	land->m_root->flagChanged(opp);
+	// Trees were refined independently so the seam may break the lod step limit
+	m_root->splitEdge(side);
+	land->m_root->splitEdge(opp);
 }
 
-/** Functor for sorting split queue */
-struct SplitCmp {
-	const Camera* cam;
-	SplitCmp(const Camera* cam) : cam(cam) {}
-	bool operator()(const Patch* a, const Patch* b) const {
-		float ea = a->projectError(cam) + (cam->onScreen(a->m_bounds)? 100: 0);
-		float eb = b->projectError(cam) + (cam->onScreen(b->m_bounds)? 100: 0);
-		return ea>eb;
+void Landscape::update(const Camera* cam) {
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+
+	// Synchronise generation threads
+	attachFinished();
+
+	// Lod only changes if the view or the leaves changed
+	if(m_lodChanged || memcmp(&m_lodView, &cam->getModelview(), sizeof(Matrix)) || memcmp(&m_lodProjection, &cam->getProjection(), sizeof(Matrix))) {
+		m_lodView = cam->getModelview();
+		m_lodProjection = cam->getProjection();
+		m_lodChanged = false;
+		updateLeaves(cam);
 	}
-};
 
-
-void Landscape::update(const Camera* cam) {
-	// Synchronise generation thread
-	
-	// Sort split queue
-	std::sort(m_splitQueue.begin(), m_splitQueue.end(), SplitCmp(cam));
-	for(uint i=0,r=0; i<m_splitQueue.size() && r<10; ++i) r+=m_splitQueue[i]->split();
-	for(uint i=0; i<m_mergeQueue.size() && i<10; ++i) m_mergeQueue[i]->merge();
-	m_splitQueue.clear();
-	m_mergeQueue.clear();
-	
-	// optimise patches (recursive)
-	m_root->update(cam);
+	// Merge then split by priority until the time budget is used. At least one attempt of each per frame.
+	// Attempts are counted rather than successes as blocked merges and splits return 0
+	Clock::time_point splitStart = Clock::now();
+	const double budget = m_budget * 1e-6;
+	const uint maxJobs = 32;
+	m_splits = m_merges = 0;
+	for(int n=0; !m_mergeQueue.empty() && (!n || std::chrono::duration<double>(Clock::now() - splitStart).count() < budget); ++n) {
+		m_merges += m_mergeQueue.pop()->merge();
+	}
+	for(int n=0; !m_splitQueue.empty() && (!n || std::chrono::duration<double>(Clock::now() - splitStart).count() < budget); ++n) {
+		if(m_threads.empty()) m_splits += m_splitQueue.pop()->split();
+		else if(m_jobCount < maxJobs) queueSplit(m_splitQueue.pop()), ++m_splits;
+		else break;
+	}
+	Clock::time_point splitEnd = Clock::now();
 
 	// Build any index arrays
 	for(uint i=0; i<m_buildList.size(); ++i) {
 		if(m_buildList[i]) m_buildList[i]->updateEdges();
 	}
 	m_buildList.clear();
+
+	m_splitTime = std::chrono::duration<float, std::micro>(splitEnd - splitStart).count();
+	m_updateTime = std::chrono::duration<float, std::micro>(Clock::now() - start).count();
 }
 int Landscape::cull(const Camera* cam) {
 	m_geometryList.clear();
-	m_root->collect(cam, m_geometryList, 0x7e);
+	cullLeaves(cam);
+	for(uint i=0; i<m_leaves.size(); ++i) {
+		if(m_leafVisible[i]) m_geometryList.push_back(&m_leaves[i]->m_geometry);
+	}
 	return m_geometryList.size();
 }
 
+void Landscape::addLeaf(Patch* p) {
+	m_lodChanged = true;
+	p->m_leaf = m_leaves.size();
+	m_leaves.push_back(p);
+	for(int i=0; i<LEAF_FIELDS; ++i) m_leafData[i].push_back(0);
+	updateLeaf(p);
+}
+
+void Landscape::removeLeaf(Patch* p) {
+	if(p->m_leaf < 0) return;
+	m_lodChanged = true;
+	m_splitQueue.remove(p);
+	// Move the last leaf into the gap
+	uint last = m_leaves.size() - 1;
+	Patch* moved = m_leaves[last];
+	m_leaves[p->m_leaf] = moved;
+	m_leaves.pop_back();
+	for(int i=0; i<LEAF_FIELDS; ++i) {
+		m_leafData[i][p->m_leaf] = m_leafData[i][last];
+		m_leafData[i].pop_back();
+	}
+	moved->m_leaf = p->m_leaf;
+	p->m_leaf = -1;
+}
+
+void Landscape::updateLeaf(Patch* p) {
+	if(p->m_leaf < 0) return;
+	m_lodChanged = true;
+	const Patch* parent = p->m_parent? p->m_parent: p;
+	const BoundingBox& b = p->m_bounds;
+	vec3 c = b.centre();
+	vec3 pc = parent->m_bounds.centre();
+	const float values[LEAF_FIELDS] = { b.min.x, b.min.y, b.min.z, b.max.x, b.max.y, b.max.z, c.x, c.y, c.z, p->m_error, pc.x, pc.y, pc.z, parent->m_error };
+	for(int i=0; i<LEAF_FIELDS; ++i) m_leafData[i][p->m_leaf] = values[i];
+}
+
+void Landscape::updateLeaves(const Camera* cam) {
+	const uint count = m_leaves.size();
+	const float maxError = m_threshold;
+	const float scale = cam->getProjection()[5] * 0.5 * 768;	// 1/tan(fov/2) / distance
+	m_leafError.resize(count);
+	m_parentError.resize(count);
+	PatchKernel::projectErrors(count, m_leafData[LEAF_X].data(), m_leafData[LEAF_Y].data(), m_leafData[LEAF_Z].data(), m_leafData[LEAF_ERROR].data(), cam->getPosition(), scale, m_leafError.data());
+	PatchKernel::projectErrors(count, m_leafData[PARENT_X].data(), m_leafData[PARENT_Y].data(), m_leafData[PARENT_Z].data(), m_leafData[PARENT_ERROR].data(), cam->getPosition(), scale, m_parentError.data());
+	cullLeaves(cam);
+
+	// Lod values and split queue
+	for(uint i=0; i<count; ++i) {
+		Patch* p = m_leaves[i];
+		float error = m_leafError[i];
+		float parentError = m_parentError[i];
+		if(parentError<=error) parentError = error*1.001;
+		float target = error==parentError? 1: (maxError-parentError) / (error-parentError);
+
+		// Force split if less than min
+		if(p->m_depth < m_min) target = 1.0;
+
+		// Queue patch for splitting? Visible patches first
+		if(target >= 1.0 && p->m_depth<m_max && !p->m_job) m_splitQueue.set(p, error + (m_leafVisible[i]? 100: 0));
+		else m_splitQueue.remove(p);
+		p->m_lod = target;
+		p->m_geometry.lod = 1-target;
+	}
+
+	// Merge when all four children are below threshold. Checked from the first child of each parent
+	for(uint i=0; i<count; ++i) {
+		Patch* parent = m_leaves[i]->m_parent;
+		if(!parent || parent->m_child[0] != m_leaves[i]) continue;
+		int m = 0;
+		for(int j=0; j<4; ++j) if(!parent->m_child[j]->m_split && parent->m_child[j]->m_lod <= 0) ++m;
+		// Lowest error and hidden patches first
+		if(m==4 && m_parentError[i] < maxError && parent->m_depth>m_min) {
+			m_mergeQueue.set(parent, maxError - m_parentError[i] + (m_leafVisible[i]? 0: 100));
+		}
+		else m_mergeQueue.remove(parent);
+	}
+}
+
+void Landscape::cullLeaves(const Camera* cam) {
+	// Frustum planes from the view projection matrix rows
+	Matrix m = cam->getProjection() * cam->getModelview();
+	float planes[24];
+	for(int i=0; i<3; ++i) {
+		for(int k=0; k<4; ++k) {
+			planes[i*8 + k]     = m[k*4+3] + m[k*4+i];
+			planes[i*8 + 4 + k] = m[k*4+3] - m[k*4+i];
+		}
+	}
+	const float* bounds[6];
+	for(int i=0; i<6; ++i) bounds[i] = m_leafData[LEAF_MIN_X + i].data();
+	m_leafVisible.resize(m_leaves.size());
+	PatchKernel::cullBoxes(m_leaves.size(), bounds, planes, m_leafVisible.data());
+}
+
 
 int Landscape::visitAllPatches(PatchFunc f) const {
 	return m_root->visitAllPatches(f);
@@ -121,8 +594,18 @@ float Landscape::getHeight(float x, float z, vec3& normal, bool real) const {
 }
 
 bool Landscape::intersect(const vec3& start, float radius, const vec3& direction, float& t, vec3& normal) const {
+	if(radius <= 0 && m_heightTree) return m_heightTree->intersect(start, direction, t, normal);
 	return m_root->intersect(start, radius, direction, t, normal);
 }
+int Landscape::intersect(int count, const vec3* start, const vec3* direction, float* t, vec3* normal, bool* hit) const {
+	if(m_heightTree) return m_heightTree->intersect(count, start, direction, t, normal, hit);
+	int hits = 0;
+	for(int i=0; i<count; ++i) {
+		hit[i] = m_root->intersect(start[i], 0, direction[i], t[i], normal[i]);
+		if(hit[i]) ++hits;
+	}
+	return hits;
+}
 bool Landscape::intersect(const vec3& start, const vec3& direction, float& t, vec3& normal) const {
 	return intersect(start, 0, direction, t, normal);
 }
@@ -136,7 +619,14 @@ bool Landscape::intersect(const vec3& a, const vec3& b, vec3& point, vec3& norma
 	return 0;
 }
 
+void Landscape::createHeightTree(float step, bool fill) {
+	delete m_heightTree;
+	m_heightTree = new HeightTree(this, m_position, m_size, step);
+	if(fill) m_heightTree->build();
+}
+
 void Landscape::updateGeometry(const BoundingBox& box, bool normals) {
+	if(m_heightTree) m_heightTree->update(box);
 	m_root->updateGeometry(box, normals);
 }
 
@@ -147,6 +637,11 @@ Landscape::Info Landscape::getInfo() const {
 	info.visiblePatches = m_geometryList.size();
 	info.splitQueue     = m_splitQueue.size();
 	info.mergeQueue     = m_mergeQueue.size();
+	info.generating     = m_jobCount;
+	info.splits         = m_splits;
+	info.merges         = m_merges;
+	info.updateTime     = m_updateTime;
+	info.splitTime      = m_splitTime;
 	info.triangles      = 0;
 	for(uint i=0; i<m_geometryList.size(); ++i) info.triangles += m_geometryList[i]->indexCount-2;
 	return info;
@@ -166,7 +661,7 @@ int Patch::getCount() const {
 Patch::Patch(Landscape* land) : m_landscape(land)
 	, m_adjacent{0,0,0,0}, m_child{0,0,0,0}, m_parent(nullptr)
 	, m_depth(0), m_lod(0), m_split(false), m_error(0)
-	, m_changed(0), m_edge{0,0,0,0}
+	, m_changed(0), m_edge{0,0,0,0}, m_job(0), m_leaf(-1), m_splitSlot(-1), m_mergeSlot(-1)
 {
 	float s = land->m_size;
 	m_corner[0] = land->m_position;
@@ -178,7 +673,7 @@ Patch::Patch(Landscape* land) : m_landscape(land)
 Patch::Patch(Patch* parent, int index) : m_landscape(parent->m_landscape)
 	, m_adjacent{0,0,0,0}, m_child{0,0,0,0}, m_parent(parent)
 	, m_depth(0), m_lod(0), m_split(false), m_error(0)
-	, m_changed(0), m_edge{0,0,0,0}
+	, m_changed(0), m_edge{0,0,0,0}, m_job(0), m_leaf(-1), m_splitSlot(-1), m_mergeSlot(-1)
 {
 	m_depth  = parent->m_depth + 1;
 
@@ -195,9 +690,11 @@ Patch::Patch(Patch* parent, int index) : m_landscape(parent->m_landscape)
 }
 
 Patch::~Patch() {
-	if(m_landscape->m_destroyCallback) m_landscape->m_destroyCallback(&m_geometry);
-	if(m_geometry.vertices) delete [] m_geometry.vertices;
-	if(m_geometry.indices) delete [] m_geometry.indices;
+	if(m_job) m_landscape->cancelSplit(this);
+	// Generated patches that were never attached have no index data
+	if(m_geometry.indices && m_landscape->m_destroyCallback) m_landscape->m_destroyCallback(&m_geometry);
+	m_landscape->m_vertexPool.release(m_geometry.vertices);
+	m_landscape->m_vertexPool.release(m_geometry.compact);
 	if(m_landscape->m_selected==this) m_landscape->m_selected = 0; // Debug
 }
 
@@ -221,48 +718,6 @@ void Patch::flagChanged(int edge) {
 	}
 }
 
-void Patch::update(const Camera* cam) {
-	const float maxError = m_landscape->m_threshold;
-	if(m_split) {
-		// Count children above merge threshold
-		int m = 0;
-		for(int i=0; i<4; ++i) {
-			m_child[i]->update(cam);
-			if(!m_child[i]->m_split && m_child[i]->m_lod <= 0) ++m;
-		}
-		// Merge
-		if(m==4) {
-			float error = projectError(cam);
-			if(error < maxError && m_depth>m_landscape->m_min) {
-				m_landscape->m_mergeQueue.push_back(this);
-			}
-		}
-	} else {
-		// Calculate error
-		float error = projectError(cam);
-		float parentError = m_parent? m_parent->projectError(cam): error;
-		if(parentError<=error) parentError = error*1.001;
-		float target = error==parentError? 1: (maxError-parentError) / (error-parentError);
-
-		// Force split if less than min
-		if(m_depth < m_landscape->m_min) target = 1.0;
-
-		// Queue patch for splitting?
-		if(target >= 1.0 && m_depth<m_landscape->m_max) {
-			m_landscape->m_splitQueue.push_back(this);
-		}
-		m_lod = target;
-		m_geometry.lod = 1-m_lod;
-	}
-}
-void Patch::collect(const Camera* cam, Landscape::GList& list, int cullFlags) const {
-	int cf = cam->onScreen(m_bounds, cullFlags);
-	if(cf==0) return;
-	if(m_split) {
-		for(int i=0; i<4; ++i) m_child[i]->collect(cam, list, cf);
-	} else list.push_back(&m_geometry);
-}
-
 int Patch::visitAllPatches(Landscape::PatchFunc f) {
 	// Recurse to children
 	if(m_split){
@@ -275,24 +730,6 @@ int Patch::visitAllPatches(Landscape::PatchFunc f) {
 	return 1;
 }
 
-float Patch::projectError(const Camera* cam) const {
-	const vec3 centre = m_bounds.centre();
-	//float d = cam->getDirection().dot( cam->getPosition() - centre );
-	float d = cam->getPosition().distance(centre);
-	
-	// Closest point on aabb
-	//vec3 cp = cam->getPosition();
-	//for(int i=0; i<3; ++i) cp[i] = fmax(fmin(cp[i], m_bounds.max[i]), m_bounds.min[i]);
-	//float d = cam->getPosition().distance(cp);
-
-
-	const Matrix& prj = cam->getProjection();
-	float p = prj[5] / d;	// 1/tan(fov/2) / d
-	float r = (p*0.5) * 768;
-
-	return r * m_error;
-}
-
 //////////////////////////////////////////////////////////////////////
 
 inline Patch* Patch::getChild(int edge, int n) const {
@@ -333,12 +770,27 @@ void Patch::clearAdjacent(int side) {
 // Split patch
 int Patch::split() {
 	if(m_split) return 0;
-	m_split = true;
+	if(m_job) m_landscape->cancelSplit(this);
 	// Create child patches
-	m_child[0] = new Patch(this, 0);
-	m_child[1] = new Patch(this, 1);
-	m_child[2] = new Patch(this, 2);
-	m_child[3] = new Patch(this, 3);
+	Patch* child[4];
+	for(int i=0; i<4; ++i) {
+		child[i] = m_landscape->createPatch(this, i);
+		child[i]->create();
+	}
+	return attach(child);
+}
+
+// Add generated child patches to the tree
+int Patch::attach(Patch** child) {
+	if(m_split) {
+		for(int i=0; i<4; ++i) m_landscape->destroyPatch(child[i]);
+		return 0;
+	}
+	m_split = true;
+	for(int i=0; i<4; ++i) m_child[i] = child[i];
+	if(m_parent) m_landscape->m_mergeQueue.remove(m_parent);
+	m_landscape->removeLeaf(this);
+	for(int i=0; i<4; ++i) m_landscape->addLeaf(m_child[i]);
 	// internal adjacency
 	m_child[0]->setAdjacent(m_child[1], 1);
 	m_child[0]->setAdjacent(m_child[2], 3);
@@ -362,11 +814,8 @@ int Patch::split() {
 	// Split any adjacent patched that require splitting to be valid
 	int a = splitAdjacent();
 
-	// Create patch geometry
-	for(int i=0; i<4; ++i) {
-		m_child[i]->create();
-		m_child[i]->build();
-	}
+	// Create patch index data
+	for(int i=0; i<4; ++i) m_child[i]->build();
 
 	return a+1;
 }
@@ -387,6 +836,14 @@ int Patch::splitAdjacent() const {
 	return count;
 }
 
+void Patch::splitEdge(int side) {
+	if(m_split) {
+		getChild(side, 0)->splitEdge(side);
+		getChild(side, 1)->splitEdge(side);
+	}
+	else splitAdjacent();
+}
+
 void Patch::cacheEdgeData() {
 	if(m_split) {
 		m_edge[0] = fmax(m_child[0]->m_edge[0], m_child[2]->m_edge[0]);
@@ -428,10 +885,12 @@ int Patch::merge() {
 			if(m_landscape->m_buildList[j]==m_child[i]) m_landscape->m_buildList[j]=0;
 		}
 		
-		delete m_child[i];
+		m_landscape->removeLeaf(m_child[i]);
+		m_landscape->destroyPatch(m_child[i]);
 		m_child[i] = 0;
 	}
 	m_split = false;
+	m_landscape->addLeaf(this);
 	for(Patch* p=this; p; p=p->m_parent) p->cacheEdgeData();
 	m_lod = 1.0;
 	flagChanged();
@@ -446,35 +905,29 @@ void Patch::create() {
 	int size = m_landscape->m_patchSize;
 	vec3 step = (m_corner[3] - m_corner[0]) / (size-1);
 	const int stride = 10; // position:3, normal:3, normal2:3, height2:1
+	const bool compact = m_landscape->m_format == Landscape::COMPACT_VERTICES;
 
-	float* vx = new float[ size * size * stride ];
+	// Compact vertices are generated as floats then packed
+	float* vx = (float*) (compact? m_landscape->m_scratchPool: m_landscape->m_vertexPool).allocate();
 	m_error = step.x * 0.1;	// factor resolution into error value
 	vec3 point;
 
-	int index = 0;
-	if(m_parent) for(index=0; index<4; ++index) if(m_parent->m_child[index]==this) break;
-	Landscape::HeightFunc func = m_landscape->m_func;
+	// Fetch all heights with a one sample border for normals
+	int gs = size + 2;
+	float* heights = new float[ gs * gs ];
+	m_landscape->fillHeights(m_corner[0], step.x, Rect(-1, -1, gs, gs), heights);
 	
 	// Create vertices
-	for(int x=0; x<size; ++x) {
-		point.x = m_corner[0].x + x*step.x;
-		for(int y=0; y<size; ++y) {
+	for(int y=0; y<size; ++y) {
+		point.z = m_corner[0].z + y*step.z;
+		for(int x=0; x<size; ++x) {
 			float* v = vx + (x + y*size)*stride;
 			// Calculate ground position
-			point.z = m_corner[0].z + y*step.z;
+			point.x = m_corner[0].x + x*step.x;
 
 			v[0] = point.x;
 			v[2] = point.z;
-
-			// Copy Get data from parent
-			if(m_parent && !((x&1) || (y&1))) {
-				int pk = x/2 + (index&1? size/2: 0) + (y/2 + (index&2? size/2: 0)) * size;
-				v[1] = v[9] = m_parent->m_geometry.vertices[pk*stride+1];
-				// copy normal
-				memcpy(v+6, &m_parent->m_geometry.vertices[pk*stride+3], 3*sizeof(float));
-			} else {
-				v[1] = v[9] = func(point);
-			}
+			v[1] = v[9] = heights[x+1 + (y+1)*gs];
 
 			// Update bounds
 			if(x+y)	m_bounds.include( vec3(point.x, v[1], point.z) );
@@ -482,73 +935,110 @@ void Patch::create() {
 		}
 	}
 
-	// Calculate normals
-	vec3 n[6], normal;
-	int s = size-1;
-	size_t ss = size * stride;
-	static const vec3 base[6] = { vec3(0,0,-1), vec3(1,0,-1), vec3(1,0,0), vec3(0,0,1), vec3(-1,0,1), vec3(-1,0,0) };
-	for(int i=0; i<6; ++i) n[i] = base[i] * step;
-	for(int x=0; x<size; ++x) {
-		for(int y=0; y<size; ++y) {
-			int k = (x+y*size)*stride + 1;
-			float h = vx[k];
-
-			// Get connected vertices
-			n[0].y = (y>0?      vx[k-ss]:        func( vec3(vx+k-1) + base[0]*step )) - h;
-			n[1].y = (y>0&&x<s? vx[k+stride-ss]: func( vec3(vx+k-1) + base[1]*step )) - h;
-			n[2].y = (x<s?      vx[k+stride]:    func( vec3(vx+k-1) + base[2]*step )) - h;
-			n[3].y = (y<s?      vx[k+ss]:        func( vec3(vx+k-1) + base[3]*step )) - h;
-			n[4].y = (x>0&&y<s? vx[k+ss-stride]: func( vec3(vx+k-1) + base[4]*step )) - h;
-			n[5].y = (x>0?      vx[k-stride]:    func( vec3(vx+k-1) + base[5]*step )) - h;
-
-			// combine
-			normal.x = normal.y = normal.z = 0;
-			for(int i=0; i<6; ++i) normal += n[i].cross( n[(i+1)%6] );
-			normal.normalise();
-
-			// Write to vertex array
-			vx[k+2] = -normal.x;
-			vx[k+3] = -normal.y;
-			vx[k+4] = -normal.z;
-		}
-	}
-
-	// Interpolate vertices to get triplanar values and error value
-	for(int x=0; x<size; ++x) {
-		for(int y=0; y<size; ++y) {
-			float* v = vx + (x + y*size)*stride;
-			float* a=0;
-			float* b=0;
-
-			// get interpolants
-			if((x&1) && (y&1)) {
-				a = vx + (x-1 + (y-1)*size) * stride;
-				b = vx + (x+1 + (y+1)*size) * stride;
-			} else if(x&1) {
-				a = vx + (x-1 + y*size) * stride;
-				b = vx + (x+1 + y*size) * stride;
-			} else if(y&1) {
-				a = vx + (x + (y-1)*size) * stride;
-				b = vx + (x + (y+1)*size) * stride;
-			}
-			
-			// Interpolate
-			if(a&&b) {
-				vec3 n = (vec3(a+3) + vec3(b+3)).normalise();
-				v[6] = n.x;
-				v[7] = n.y;
-				v[8] = n.z;
-				v[9] = (a[1] + b[1]) * 0.5;
-				m_error = fmax( fabs(v[9]-v[1]), m_error);
-			} else {
-				memcpy(v+6, v+3, 3*sizeof(float));
-			}
-		}
+	// Normals and lod blend targets
+	int count = size * size;
+	float* planar = new float[ count * 8 ];
+	float* h  = planar;
+	float* n  = planar + count;
+	float* bn = planar + count * 4;
+	float* bh = planar + count * 7;
+	for(int y=0; y<size; ++y) memcpy(h + y*size, heights + 1 + (y+1)*gs, size * sizeof(float));
+	PatchKernel::normals(heights, size, size, step.x, step.z, n, n+count, n+count*2);
+	PatchKernel::blend(size, 0, 0, size-1, size-1, h, n, n+count, n+count*2, bh, bn, bn+count, bn+count*2);
+	delete [] heights;
+
+	// Write to vertex array. Error is kept per region for partial updates
+	for(int i=0; i<16; ++i) m_regionError[i] = 0;
+	for(int i=0; i<count; ++i) {
+		float* v = vx + i * stride;
+		v[3] = n[i];
+		v[4] = n[i + count];
+		v[5] = n[i + count*2];
+		v[6] = bn[i];
+		v[7] = bn[i + count];
+		v[8] = bn[i + count*2];
+		v[9] = bh[i];
+		float& e = m_regionError[ (i%size)*4/size + (i/size)*4/size*4 ];
+		e = fmax( fabs(v[9]-v[1]), e);
 	}
+	for(int i=0; i<16; ++i) m_error = fmax(m_regionError[i], m_error);
+	delete [] planar;
 
 	m_geometry.vertexCount = size * size;
-	m_geometry.vertices = vx;
 	m_geometry.bounds = &m_bounds;
+	if(compact) {
+		m_geometry.compact = (CompactVertex*) m_landscape->m_vertexPool.allocate();
+		packVertices(vx, 0, 0, size-1, size-1);
+		m_landscape->m_scratchPool.release(vx);
+	}
+	else m_geometry.vertices = vx;
+}
+
+static inline uint16 quantise16(float v) { return v<=0? 0: v>=65535? 65535: (uint16)(v + 0.5f); }
+static inline short  quantiseNormal(float v) { return (short) floor(v * 32767.f + 0.5f); }
+static inline float  signOf(float v) { return v<0? -1.f: 1.f; }
+
+// Octahedral normal encoding with the y axis as the pole as terrain normals are mostly up
+static void encodeNormal(const float* n, short* out) {
+	float l = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+	if(l <= 0) { out[0] = out[1] = 0; return; }
+	float x = n[0] / l;
+	float z = n[2] / l;
+	if(n[1] < 0) {
+		float t = x;
+		x = (1 - fabs(z)) * signOf(x);
+		z = (1 - fabs(t)) * signOf(z);
+	}
+	out[0] = quantiseNormal(x);
+	out[1] = quantiseNormal(z);
+}
+
+static void decodeNormal(const short* in, float* n) {
+	float x = in[0] / 32767.f;
+	float z = in[1] / 32767.f;
+	float y = 1 - fabs(x) - fabs(z);
+	if(y < 0) {
+		float t = x;
+		x = (1 - fabs(z)) * signOf(x);
+		z = (1 - fabs(t)) * signOf(z);
+	}
+	float l = sqrt(x*x + y*y + z*z);
+	n[0] = x / l;
+	n[1] = y / l;
+	n[2] = z / l;
+}
+
+void Patch::packVertices(const float* vx, int x0, int y0, int x1, int y1) {
+	// Heights are relative to the patch bounds
+	const int size = m_landscape->m_patchSize;
+	float range = m_bounds.max.y - m_bounds.min.y;
+	float scale = range>0? 65535 / range: 0;
+	m_geometry.heightOffset = m_bounds.min.y;
+	m_geometry.heightScale = range / 65535;
+	for(int y=y0; y<=y1; ++y) for(int x=x0; x<=x1; ++x) {
+		const float* v = vx + (x + y*size) * 10;
+		CompactVertex& c = m_geometry.compact[x + y*size];
+		c.height = quantise16((v[1] - m_bounds.min.y) * scale);
+		c.blendHeight = quantise16((v[9] - m_bounds.min.y) * scale);
+		encodeNormal(v+3, c.normal);
+		encodeNormal(v+6, c.blendNormal);
+	}
+}
+
+void Patch::getVertex(uint index, float* v) const {
+	if(m_geometry.vertices) {
+		memcpy(v, m_geometry.vertices + index * 10, 10 * sizeof(float));
+		return;
+	}
+	int size = m_landscape->m_patchSize;
+	vec3 step = (m_corner[3] - m_corner[0]) / (size-1);
+	const CompactVertex& c = m_geometry.compact[index];
+	v[0] = m_corner[0].x + (index % size) * step.x;
+	v[2] = m_corner[0].z + (index / size) * step.z;
+	v[1] = m_geometry.heightOffset + c.height * m_geometry.heightScale;
+	v[9] = m_geometry.heightOffset + c.blendHeight * m_geometry.heightScale;
+	decodeNormal(c.normal, v+3);
+	decodeNormal(c.blendNormal, v+6);
 }
 
 
@@ -562,19 +1052,61 @@ void Patch::create() {
 
 // Build index array
 void Patch::build() {
-	int size = m_landscape->m_patchSize;
+	m_geometry.indexCount = m_landscape->m_indexCount;
+	m_geometry.indexSize = m_landscape->m_indexSize;
+	m_geometry.indexKey = getIndexKey();
+	m_geometry.indices = m_landscape->getIndices(m_geometry.indexKey);
+	if(m_landscape->m_createCallback) m_landscape->m_createCallback(&m_geometry);
+	flagChanged();
+}
 
-	// Allocate array
-	int count = (size * 2 + 4) * (size-1) - 4;
-	if(m_geometry.indices) delete [] m_geometry.indices;
-	m_geometry.indices = new uint16[ count ];
-	m_geometry.indexCount = count;
+void Patch::updateEdges() {
+	if(m_changed) {
+		m_geometry.indexKey = getIndexKey();
+		m_geometry.indices = m_landscape->getIndices(m_geometry.indexKey);
+	}
+	m_changed = 0;
+}
 
-	// Generate indices
-	//for(uint i=0; i<strips; ++i) addStrip(i, step);
-	
+uint Patch::getIndexKey() const {
+	int n = m_landscape->m_patchStep + 1;
+	uint key = 0;
+	for(int edge=3; edge>=0; --edge) {
+		int s = getAdjacentStep(edge);
+		s = s<0? 0: s>=n? n-1: s;
+		key = key * n + s;
+	}
+	return key;
+}
+
+const void* Landscape::getIndices(uint key) {
+	if(m_indexArrays.empty()) {
+		uint n = m_patchStep + 1;
+		m_indexArrays.resize(n*n*n*n, 0);
+	}
+	if(!m_indexArrays[key]) {
+		if(m_indexSize==4) m_indexArrays[key] = createIndices<uint32>(key);
+		else m_indexArrays[key] = createIndices<uint16>(key);
+	}
+	return m_indexArrays[key];
+}
 
-	uint16* ix = m_geometry.indices;
+void Landscape::clearIndices() {
+	for(size_t i=0; i<m_indexArrays.size(); ++i) {
+		if(m_indexSize==4) delete [] static_cast<uint32*>(m_indexArrays[i]);
+		else delete [] static_cast<uint16*>(m_indexArrays[i]);
+	}
+	m_indexArrays.clear();
+}
+
+template<typename T> T* Landscape::createIndices(uint key) const {
+	int size = m_patchSize;
+	int rowSize = size * 2 + 4;
+	uint n = m_patchStep + 1;
+	T* indices = new T[ m_indexCount ];
+
+	// Full resolution strips
+	T* ix = indices;
 	for(int y=0; y<size-1; ++y) {
 		// connect to previous strip
 		if(y>0) {
@@ -590,55 +1122,39 @@ void Patch::build() {
 		}
 	}
 
-	if(m_landscape->m_createCallback) m_landscape->m_createCallback(&m_geometry);
-	flagChanged();
-}
-
-void Patch::updateEdges() {
-	if(m_changed&1) updateEdge(0);
-	if(m_changed&2) updateEdge(1);
-	if(m_changed&4) updateEdge(2);
-	if(m_changed&8) updateEdge(3);
-	if(m_changed && m_landscape->m_updateCallback)
-		m_landscape->m_updateCallback(&m_geometry);
-	m_changed = 0;
-}
-
-void Patch::updateEdge(int edge) {
-	int size = m_landscape->m_patchSize;
-	int rowSize = size * 2 + 4;
-	int s = getAdjacentStep(edge);
-	s = s>0? 1<<s: 1;
-
-	switch(edge) {
-	case 0:
-		for(int i=1; i<size-1; ++i) {
-			int v = i%s<=s/2? i/s*s: (i/s+1)*s;
-			uint16* ix = m_geometry.indices + i*rowSize;
-			*ix = v * size;
-			ix[1-rowSize] = ix[-1] = ix[-2] = *ix;
-		} break;
-	case 1:
-		for(int i=1; i<size-1; ++i) {
-			int v = s==1? i: i%s<s/2? i/s*s: (i/s+1)*s;
-			uint16* ix = m_geometry.indices + i*rowSize + rowSize-6;
-			*ix = size-1 + v * size;
-			ix[1-rowSize] = ix[2-rowSize] = ix[3-rowSize] = *ix;
-		} break;
-	case 2:
-		for(int i=1; i<size-1; ++i) {
-			int v = i%s<=s/2? i/s*s: (i/s+1)*s;
-			uint16* ix = m_geometry.indices + i*2;
-			*ix = v;
-		} break;
-	case 3:
-		for(int i=1; i<size-1; ++i) {
-			int v = s==1? i: i%s<s/2? i/s*s: (i/s+1)*s;
-			uint16* ix = m_geometry.indices + (size-2)*rowSize+1 + i*2;
-			*ix = (size-1)*size + v;
-		} break;
-	}
-	//m_changed &= ~(1<<edge);
+	// Snap edge vertices to the step of the neighbouring patch
+	for(int edge=0; edge<4; ++edge, key/=n) {
+		int s = 1 << (key % n);
+		switch(edge) {
+		case 0:
+			for(int i=1; i<size-1; ++i) {
+				int v = i%s<=s/2? i/s*s: (i/s+1)*s;
+				ix = indices + i*rowSize;
+				*ix = v * size;
+				ix[1-rowSize] = ix[-1] = ix[-2] = *ix;
+			} break;
+		case 1:
+			for(int i=1; i<size-1; ++i) {
+				int v = s==1? i: i%s<s/2? i/s*s: (i/s+1)*s;
+				ix = indices + i*rowSize + rowSize-6;
+				*ix = size-1 + v * size;
+				ix[1-rowSize] = ix[2-rowSize] = ix[3-rowSize] = *ix;
+			} break;
+		case 2:
+			for(int i=1; i<size-1; ++i) {
+				int v = i%s<=s/2? i/s*s: (i/s+1)*s;
+				ix = indices + i*2;
+				*ix = v;
+			} break;
+		case 3:
+			for(int i=1; i<size-1; ++i) {
+				int v = s==1? i: i%s<s/2? i/s*s: (i/s+1)*s;
+				ix = indices + (size-2)*rowSize+1 + i*2;
+				*ix = (size-1)*size + v;
+			} break;
+		}
+	}
+	return indices;
 }
 
 int Patch::getAdjacentStep(int side) const {
@@ -651,122 +1167,171 @@ int Patch::getAdjacentStep(int side) const {
 
 // ====================== Update Geometry ================================== //
 
-inline void clampVec(vec2& v, float min, float max) {
-	if(v.x<min) v.x=min; else if(v.x>max) v.x=max;
-	if(v.y<min) v.y=min; else if(v.y>max) v.y=max;
+void Patch::fillBorder(const Rect& grid, const Rect& part, float* heights) const {
+	vec3 step = (m_corner[3] - m_corner[0]) / (m_landscape->m_patchSize-1);
+	float* values = new float[ part.width * part.height ];
+	m_landscape->fillHeights(m_corner[0], step.x, part, values);
+	for(int y=0; y<part.height; ++y) for(int x=0; x<part.width; ++x) {
+		heights[part.x-grid.x+x + (part.y-grid.y+y)*grid.width] = values[x + y*part.width];
+	}
+	delete [] values;
 }
 
 void Patch::updateGeometry(const BoundingBox& box, bool normals) {
+	// Pending split has old heights
+	if(m_job) m_landscape->cancelSplit(this);
+	const int stride = 10;
+	int  size = m_landscape->m_patchSize;
+	vec3 step = (m_corner[3] - m_corner[0]) / (size-1);
+
+	// Children first so their heights can be reused. Vertices two child steps outside the box have changed normals
 	if(m_split) {
 		vec3 c = m_child[0]->m_corner[3]; // Patch centre point
-		if(box.min.x <= c.x && box.min.z <= c.z) m_child[0]->updateGeometry(box, normals);
-		if(box.max.x >= c.x && box.min.z <= c.z) m_child[1]->updateGeometry(box, normals);
-		if(box.min.x <= c.x && box.max.z >= c.z) m_child[2]->updateGeometry(box, normals);
-		if(box.max.x >= c.x && box.max.z >= c.z) m_child[3]->updateGeometry(box, normals);
+		float m = step.x;
+		if(box.min.x-m <= c.x && box.min.z-m <= c.z) m_child[0]->updateGeometry(box, normals);
+		if(box.max.x+m >= c.x && box.min.z-m <= c.z) m_child[1]->updateGeometry(box, normals);
+		if(box.min.x-m <= c.x && box.max.z+m >= c.z) m_child[2]->updateGeometry(box, normals);
+		if(box.max.x+m >= c.x && box.max.z+m >= c.z) m_child[3]->updateGeometry(box, normals);
 	}
 
-	// Update vertex positions
-	const int stride = 10;
-	int  size = m_landscape->m_patchSize;
-	vec3 step = (m_corner[3] - m_corner[0]) / (size-1);
+	// Vertices inside the edit box. Normals depend on adjacent heights, and lod blend targets on adjacent normals
 	vec2 a = ceil( (box.min - m_corner[0]) / step).xz();
 	vec2 b = floor((box.max - m_corner[0]) / step).xz();
-	clampVec(a, 0, size-1);
-	clampVec(b, 0, size-1);
-
-	// get data from children to avoid calculation
-	if(m_split && 0) {
-		for(int x=a.x; x<=b.x; ++x) for(int y=a.y; y<=b.y; ++y) {
-			float* v = m_geometry.vertices + (x + y*size) * stride;
-			int ci = (x>size/2?1:0) | (y>size/2? 2:0);
-			int cx = (x - (ci&1? size/2: 0)) * 2;
-			int cy = (y - (ci&2? size/2: 0)) * 2;
-			float* cv = m_child[ci]->m_geometry.vertices + (cx+cy*size) * stride;
-			// Set values
-			v[1] = cv[1];	// height
-			v[3] = cv[3];	// normal
-			v[4] = cv[4];
-			v[5] = cv[5];
-			v[9] = cv[1];	// interpolated height
-			m_bounds.include( vec3(v) );
+	const int x0 = std::max((int)a.x, 0), y0 = std::max((int)a.y, 0), x1 = std::min((int)b.x, size-1), y1 = std::min((int)b.y, size-1);
+	const int nx0 = std::max((int)a.x-1, 0), ny0 = std::max((int)a.y-1, 0), nx1 = std::min((int)b.x+1, size-1), ny1 = std::min((int)b.y+1, size-1);
+	const int bx0 = std::max((int)a.x-2, 0), by0 = std::max((int)a.y-2, 0), bx1 = std::min((int)b.x+2, size-1), by1 = std::min((int)b.y+2, size-1);
+	const bool changed = bx0<=bx1 && by0<=by1;
+
+	if(changed) {
+		// Error regions containing the changed vertices
+		const int rx0 = bx0*4/size, ry0 = by0*4/size, rx1 = bx1*4/size, ry1 = by1*4/size;
+
+		// Compact vertices are unpacked around the edit. Blend targets read one vertex further
+		const int ux0 = std::min(std::max(bx0-1, 0), (rx0*size+3)/4);
+		const int uy0 = std::min(std::max(by0-1, 0), (ry0*size+3)/4);
+		const int ux1 = std::max(std::min(bx1+1, size-1), ((rx1+1)*size+3)/4-1);
+		const int uy1 = std::max(std::min(by1+1, size-1), ((ry1+1)*size+3)/4-1);
+		float* vertices = m_geometry.vertices;
+		if(m_geometry.compact) {
+			vertices = (float*) m_landscape->m_scratchPool.allocate();
+			for(int y=uy0; y<=uy1; ++y) for(int x=ux0; x<=ux1; ++x) getVertex(x + y*size, vertices + (x + y*size) * stride);
 		}
 
-	} else {
-		Landscape::HeightFunc func = m_landscape->m_func;
-		
-		// Update base heights
-		for(int x=a.x; x<=b.x; ++x) for(int y=a.y; y<=b.y; ++y) {
-			float* v = m_geometry.vertices + (x + y*size) * stride;
-			vec3 p(v[0], 0, v[2]);
-			v[1] = v[9] = p.y = func(p);
-			m_bounds.include(p);
+		// Edited heights. Children have the same samples at double resolution
+		if(m_split) {
+			const int half = (size-1) / 2;
+			float cv[stride];
+			for(int y=y0; y<=y1; ++y) for(int x=x0; x<=x1; ++x) {
+				int ci = (x>half? 1: 0) | (y>half? 2: 0);
+				int cx = (x - (ci&1? half: 0)) * 2;
+				int cy = (y - (ci&2? half: 0)) * 2;
+				m_child[ci]->getVertex(cx + cy*size, cv);
+				vertices[(x + y*size) * stride + 1] = cv[1];
+			}
+		}
+		else if(x0<=x1 && y0<=y1) {
+			Rect e(x0, y0, x1-x0+1, y1-y0+1);
+			float* edited = new float[ e.width * e.height ];
+			m_landscape->fillHeights(m_corner[0], step.x, e, edited);
+			for(int y=y0; y<=y1; ++y) for(int x=x0; x<=x1; ++x) {
+				vertices[(x + y*size) * stride + 1] = edited[x-x0 + (y-y0)*e.width];
+			}
+			delete [] edited;
+		}
+
+		// Heights for normals with a one sample border. Only samples outside the patch are read from the source
+		Rect r(nx0-1, ny0-1, nx1-nx0+3, ny1-ny0+3);
+		float* heights = new float[ r.width * r.height ];
+		for(int y=std::max(r.y,0); y<std::min(r.bottom(),size); ++y) {
+			for(int x=std::max(r.x,0); x<std::min(r.right(),size); ++x) {
+				heights[x-r.x + (y-r.y)*r.width] = vertices[(x + y*size) * stride + 1];
+			}
+		}
+		if(r.x < 0)           fillBorder(r, Rect(r.x, r.y, 1, r.height), heights);
+		if(r.right() > size)  fillBorder(r, Rect(size, r.y, 1, r.height), heights);
+		if(r.y < 0)           fillBorder(r, Rect(r.x, r.y, r.width, 1), heights);
+		if(r.bottom() > size) fillBorder(r, Rect(r.x, size, r.width, 1), heights);
+		for(int y=y0; y<=y1; ++y) for(int x=x0; x<=x1; ++x) {
+			m_bounds.include( vec3(vertices + (x + y*size) * stride) );
 		}
 
 		// Update normals
 		if(normals) {
-			vec3 n[6], normal;
-			int s = size - 1, ss = size * stride;
-			static const vec3 base[6] = { vec3(0,0,-1), vec3(1,0,-1), vec3(1,0,0), vec3(0,0,1), vec3(-1,0,1), vec3(-1,0,0) };
-			for(int i=0; i<6; ++i) n[i] = base[i] * step;
-			for(int x=a.x; x<=b.x; ++x) for(int y=a.y; y<=b.y; ++y) {
-				float* vx = m_geometry.vertices + (x + y*size) * stride;
-				// Get connected vertices
-				n[0].y = (y>0?      vx[1-ss]:        func( vec3(vx) + base[0]*step )) - vx[1];
-				n[1].y = (y>0&&x<s? vx[1+stride-ss]: func( vec3(vx) + base[1]*step )) - vx[1];
-				n[2].y = (x<s?      vx[1+stride]:    func( vec3(vx) + base[2]*step )) - vx[1];
-				n[3].y = (y<s?      vx[1+ss]:        func( vec3(vx) + base[3]*step )) - vx[1];
-				n[4].y = (x>0&&y<s? vx[1+ss-stride]: func( vec3(vx) + base[4]*step )) - vx[1];
-				n[5].y = (x>0?      vx[1-stride]:    func( vec3(vx) + base[5]*step )) - vx[1];
-
-				// combine
-				normal.x = normal.y = normal.z = 0;
-				for(int i=0; i<6; ++i) normal -= n[i].cross( n[(i+1)%6] );
-				normal.normalise();
-				memcpy(vx+3, normal, sizeof(vec3));
+			int w = r.width - 2;
+			int h = r.height - 2;
+			float* n = new float[ w * h * 3 ];
+			PatchKernel::normals(heights, w, h, step.x, step.z, n, n+w*h, n+w*h*2);
+			for(int y=0; y<h; ++y) for(int x=0; x<w; ++x) {
+				float* v = vertices + (nx0+x + (ny0+y)*size) * stride;
+				int i = x + y*w;
+				v[3] = n[i];
+				v[4] = n[i + w*h];
+				v[5] = n[i + w*h*2];
 			}
+			delete [] n;
 		}
-	}
-
-	// Update interpolated values
-	for(int x=a.x; x<=b.x; ++x) for(int y=a.y; y<=b.y; ++y) {
-		float* v = m_geometry.vertices + (x + y*size)*stride;
-		float* a=0;
-		float* b=0;
-
-		// get interpolants
-		if((x&1) && (y&1)) {
-			a = v - (size+1) * stride;
-			b = v + (size+1) * stride;
-		} else if(x&1) {
-			a = v - stride;
-			b = v + stride;
-		} else if(y&1) {
-			a = v - size * stride;
-			b = v + size * stride;
+		delete [] heights;
+
+		// Update interpolated values
+		int count = size * size;
+		float* planar = new float[ count * 8 ]();
+		float* h  = planar;
+		float* n  = planar + count;
+		float* bn = planar + count * 4;
+		float* bh = planar + count * 7;
+		for(int y=uy0; y<=uy1; ++y) for(int x=ux0; x<=ux1; ++x) {
+			int i = x + y*size;
+			const float* v = vertices + i * stride;
+			h[i] = v[1];
+			n[i] = v[3];
+			n[i + count] = v[4];
+			n[i + count*2] = v[5];
+		}
+		PatchKernel::blend(size, bx0, by0, bx1, by1, h, n, n+count, n+count*2, bh, bn, bn+count, bn+count*2);
+		for(int y=by0; y<=by1; ++y) for(int x=bx0; x<=bx1; ++x) {
+			int i = x + y*size;
+			float* v = vertices + i * stride;
+			v[6] = bn[i];
+			v[7] = bn[i + count];
+			v[8] = bn[i + count*2];
+			v[9] = bh[i];
+		}
+		delete [] planar;
+
+		// Error of affected regions
+		for(int ry=ry0; ry<=ry1; ++ry) for(int rx=rx0; rx<=rx1; ++rx) {
+			float e = 0;
+			for(int y=(ry*size+3)/4; y<((ry+1)*size+3)/4; ++y) for(int x=(rx*size+3)/4; x<((rx+1)*size+3)/4; ++x) {
+				const float* v = vertices + (x + y*size) * stride;
+				e = fmax(fabs(v[9] - v[1]), e);
+			}
+			m_regionError[rx + ry*4] = e;
 		}
 
-		// Interpolate values
-		if(a&&b) {
-			vec3 n = (vec3(a+3) + vec3(b+3)).normalise();
-			v[6] = n.x;
-			v[7] = n.y;
-			v[8] = n.z;
-			v[9] = (a[1] + b[1]) * 0.5;
-		} else {
-			memcpy(v+6, v+3, 3*sizeof(float));
-			v[9] = v[1];
+		// Everything is requantised if the height range changed
+		if(m_geometry.compact) {
+			if(m_bounds.min.y != m_geometry.heightOffset || (m_bounds.max.y - m_bounds.min.y) / 65535 != m_geometry.heightScale) {
+				for(int i=0; i<count; ++i) {
+					int x = i % size, y = i / size;
+					if(x<ux0 || x>ux1 || y<uy0 || y>uy1) getVertex(i, vertices + i * stride);
+				}
+				packVertices(vertices, 0, 0, size-1, size-1);
+			}
+			else packVertices(vertices, bx0, by0, bx1, by1);
+			m_landscape->m_scratchPool.release(vertices);
 		}
 	}
 
-	// Update error value
-	m_error = step.x * 0.3;	// factor resolution into error value
+	// Error bound includes children
+	m_error = step.x * 0.1;	// factor resolution into error value
+	for(int i=0; i<16; ++i) m_error = fmax(m_regionError[i], m_error);
 	if(m_split) for(int i=0; i<4; ++i) m_error = fmax(m_error, m_child[i]->m_error);
-	for(int i=0; i<size*size; ++i) {
-		float* v = m_geometry.vertices + i * stride;
-		m_error = fmax( fabs(v[9] - v[1]), m_error);
-	}
 
-	if(m_landscape->m_updateCallback) m_landscape->m_updateCallback(&m_geometry);
+	// Error and bounds changed
+	m_landscape->updateLeaf(this);
+	if(m_split) for(int i=0; i<4; ++i) m_landscape->updateLeaf(m_child[i]);
+
+	if(changed && m_landscape->m_updateCallback) m_landscape->m_updateCallback(&m_geometry);
 }
 
 
@@ -792,23 +1357,27 @@ float Patch::getHeight(float x, float z, vec3* normal) const {
 	int iz = floor(z); z-=iz;
 	if(ix==size-1) --ix, x=1;	// Fix if on the edge
 	if(iz==size-1) --iz, z=1;
-	const int stride = 10;
 
-	const float* v0;
-	const float* v1 = m_geometry.vertices + (ix+1 + iz*size) * stride;
-	const float* v2 = m_geometry.vertices + (ix + (iz+1)*size) * stride;
+	uint i0;
+	uint i1 = ix+1 + iz*size;
+	uint i2 = ix + (iz+1)*size;
 	if(x+z>1) {
 		float t = x; x = 1 - z; z = 1 - t;
-		v0 = m_geometry.vertices  + (ix+1 + (iz+1)*size) * stride;
-	} else v0 = m_geometry.vertices + (ix+iz*size) * stride;
+		i0 = ix+1 + (iz+1)*size;
+	} else i0 = ix+iz*size;
 
 	float h;
 	float lod = m_lod<0? 0: m_lod>1? 1: m_lod;
 	lod = 1;
 
 	// Debug
-	float* end = m_geometry.vertices+size*size*stride;
-	if(v0>=end || v1>=end || v2>=end) { printf("Error: Index out of bounds\n"); assert(false); }
+	uint end = size*size;
+	if(i0>=end || i1>=end || i2>=end) { printf("Error: Index out of bounds\n"); assert(false); }
+
+	float v0[10], v1[10], v2[10];
+	getVertex(i0, v0);
+	getVertex(i1, v1);
+	getVertex(i2, v2);
 
 	// Interpolate height
 	#define lerp(a,b,t) (a+(b-a)*t)
@@ -864,13 +1433,14 @@ const Patch* Patch::intersect(const vec3& start, float radius, const vec3& direc
 }
 
 bool Patch::getTriangle(uint i, float lod, vec3& a, vec3& b, vec3& c) const {
-	const uint16* ix = m_geometry.indices;
-	if(ix[i]==ix[i+1] || ix[i+1]==ix[i+2] || ix[i]==ix[i+2]) return false;
+	uint ix[3];
+	for(int k=0; k<3; ++k) ix[k] = m_geometry.indexSize==4? static_cast<const uint32*>(m_geometry.indices)[i+k]: static_cast<const uint16*>(m_geometry.indices)[i+k];
+	if(ix[0]==ix[1] || ix[1]==ix[2] || ix[0]==ix[2]) return false;
 	const int flip = i&1; // Triangle strip needs to flip odd polygons
-	const float* vx = m_geometry.vertices;
-	const float* pa = vx + ix[i+0] * 10;
-	const float* pb = vx + ix[i+1+flip] * 10;
-	const float* pc = vx + ix[i+2-flip] * 10;
+	float pa[10], pb[10], pc[10];
+	getVertex(ix[0], pa);
+	getVertex(ix[1+flip], pb);
+	getVertex(ix[2-flip], pc);
 	a = vec3(pa[0], pa[1]*lod + (1-lod)*pa[9], pa[2]);
 	b = vec3(pb[0], pb[1]*lod + (1-lod)*pb[9], pb[2]);
 	c = vec3(pc[0], pc[1]*lod + (1-lod)*pc[9], pc[2]);
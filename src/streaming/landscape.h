@@ -3,6 +3,8 @@
 
 #include <base/math.h>
 #include <base/thread.h>
+#include <condition_variable>
+#include <mutex>
 #include <vector>
 
 #ifdef LANDSCAPE_DELEGATE
@@ -11,6 +13,7 @@
 
 namespace base { class Material; class Camera; }
 class Patch;
+class HeightTree;
 
 /** Patch Indexing
  *
@@ -25,26 +28,84 @@ class Patch;
  * */
 
 
+/** Compact vertex format. Position x,z is implied by the vertex index: x = index % patchSize, z = index / patchSize */
+struct CompactVertex {
+	uint16 height;			// Height = heightOffset + height * heightScale
+	uint16 blendHeight;		// Lod blend height
+	short  normal[2];		// Octahedral encoded normal, y axis is the pole
+	short  blendNormal[2];	// Octahedral encoded lod blend normal
+};
+
 /** Geometry data of patch */
 struct PatchGeometry {
 	size_t       vertexCount=0;		// Number of vertices
 	size_t       indexCount=0;		// Number of indices
 	float*       vertices=nullptr;  // Vertex data - Format: POSITION3 NORMAL3 BLEND_NORMAL3 BLEND_HEIGHT:1 (stride:10)
-	uint16*      indices=nullptr;	// Index data
+	CompactVertex* compact=nullptr;	// Vertex data if using compact format. Replaces vertices
+	float        heightOffset=0;	// Compact height decoding
+	float        heightScale=0;
+	const void*  indices=nullptr;	// Index data - shared by all patches with the same indexKey
+	uint         indexSize=2;		// Bytes per index: uint16, or uint32 if the patch has more than 65536 vertices
+	uint         indexKey=0;		// Edge stitching configuration
 	BoundingBox* bounds=nullptr;	// Bounding box
 	float        lod=0;				// Lod blend value [0-1]
 	void*        tag=nullptr;		// User data
 };
 
 
+/** Free list of fixed size memory blocks allocated in slabs. Thread safe */
+class BlockPool {
+	public:
+	BlockPool(size_t blockSize=0, size_t slabCount=64);
+	~BlockPool();
+	void   setBlockSize(size_t bytes);	// Only valid when no blocks are live
+	void*  allocate();
+	void   release(void* block);
+	size_t live() const   { return m_live; }
+	size_t pooled() const { return m_free.size(); }
+
+	protected:
+	size_t             m_blockSize;
+	size_t             m_slabCount;	// Blocks per slab
+	size_t             m_live;
+	std::vector<char*> m_slabs;
+	std::vector<void*> m_free;
+	std::mutex         m_mutex;
+};
+
+
+/** Priority queue of patches that persists between frames. Highest priority first.
+ *  Each patch stores its heap position so entries can be reprioritised or removed in place */
+class PatchQueue {
+	public:
+	PatchQueue(int Patch::* slot) : m_slot(slot) {}
+	void   set(Patch*, float priority);	// Add or reprioritise
+	void   remove(Patch*);
+	Patch* pop();
+	void   clear();
+	bool   empty() const { return m_heap.empty(); }
+	size_t size() const  { return m_heap.size(); }
+
+	protected:
+	struct Entry { float priority; Patch* patch; };
+	std::vector<Entry> m_heap;
+	int Patch::*       m_slot;	// Heap index member, -1 if not queued
+	void up(int);
+	void down(int);
+	void place(int, const Entry&);
+};
+
+
 /** Geo-Mipmap Landscape - uses separate thread for generation, trilinear filtering */
 class Landscape {
 	public:
 	#ifdef LANDSCAPE_DELEGATE
 	typedef Delegate<float(const vec3&)> HeightFunc;
+	typedef Delegate<void(const vec3&, float, const Rect&, float*)> HeightBlockFunc;
 	typedef Delegate<void(PatchGeometry*)> PatchFunc;
 	#else
 	typedef float(*HeightFunc)(const vec3&);
+	typedef void(*HeightBlockFunc)(const vec3&, float, const Rect&, float*);
 	typedef void(*PatchFunc)(PatchGeometry*);
 	#endif
 
@@ -59,7 +120,27 @@ class Landscape {
 	/** Set the detail error threshold. Default: 8 */
 	void setThreshold(float value);
 
-	/** Allow multiple landscapes to be stiched together */
+	/** Set number of threads generating split patches. 0 splits on the main thread. Default: 0
+	 *  Height functions must be thread safe to use threads */
+	void setThreads(int count);
+
+	/** Time limit for splitting and merging patches in update(), in microseconds. Default: 2000 */
+	void setUpdateBudget(float microseconds);
+
+	/** Set the vertex format. Must be called before setHeightFunction. Default: FLOAT_VERTICES */
+	enum VertexFormat { FLOAT_VERTICES, COMPACT_VERTICES };
+	void setVertexFormat(VertexFormat);
+	VertexFormat getVertexFormat() const { return m_format; }
+
+	/** Set the number of vertices along a patch edge. Must be a power of 2 plus 1, from 5 to 513.
+	 *  Larger patches mean fewer draw calls and patches, but coarser lod steps. Must be called before setHeightFunction. Default: 9 */
+	void setPatchSize(uint size);
+
+	/** Number of vertices along a patch edge */
+	uint getPatchSize() const { return m_patchSize; }
+
+	/** Stitch to an adjacent landscape of the same size and patch size. Lod steps are limited across the seam.
+	 *  Side is the edge of this landscape: 0:-x, 1:+x, 2:-z, 3:+z. Null disconnects */
 	void connect(Landscape*, int side);
 
 	/** Update all */
@@ -74,8 +155,13 @@ class Landscape {
 	float getHeight(float x, float z, bool real=false) const;
 	float getHeight(float x, float z, vec3& normal, bool real=false) const;
 
-	/** Set the height generation function */
-	void setHeightFunction(HeightFunc);
+	/** Set the height generation function.
+	 *  Optional block function fills a grid of heights in one call: Sample (x,y) of rect is at origin + (x*step, 0, y*step).
+	 *  Output is row major, rect.width * rect.height values */
+	void setHeightFunction(HeightFunc, HeightBlockFunc block=0);
+
+	/** Get a grid of heights using the block function if set */
+	void fillHeights(const vec3& origin, float step, const Rect& rect, float* out) const;
 
 	/** Set the material callbacks */
 	void setPatchCallbacks(PatchFunc created, PatchFunc destroyed, PatchFunc updated);
@@ -91,10 +177,32 @@ class Landscape {
 	bool intersect(const vec3& start, const vec3& normalisedDirection, float& t, vec3& normal) const;
 	bool intersect(const vec3& start, float radius, const vec3& normalisedDirection, float& t, vec3& normal) const;
 
+	/** Use a min/max height tree for exact ray intersection with the source heights instead of the current lod geometry.
+	 *  step is the source sample spacing. fill reads all heights now, otherwise blocks are read as rays reach them */
+	void createHeightTree(float step, bool fill=true);
+
+	/** Intersect a batch of rays. t is the maximum distance on input and the hit distance on output. Returns the number of hits */
+	int intersect(int count, const vec3* start, const vec3* normalisedDirection, float* t, vec3* normal, bool* hit) const;
+
 	/** Information */
-	struct Info { int patches, visiblePatches, triangles, splitQueue, mergeQueue; };
+	struct Info {
+		int patches, visiblePatches, triangles, splitQueue, mergeQueue, generating;
+		int splits, merges;			// Last update
+		float updateTime, splitTime;	// Last update total and split/merge time in microseconds
+	};
 	Info getInfo() const;
 
+	/** Memory pool usage in blocks */
+	struct PoolInfo { size_t live, pooled; };
+	void getPoolInfo(PoolInfo& patches, PoolInfo& vertices) const;
+
+	/** Get the shared index array for an edge stitching configuration. Index type is uint16 or uint32 from getIndexSize() */
+	const void* getIndices(uint key);
+	uint getIndexSize() const { return m_indexSize; }
+
+	/** Compare patch sizes on a generated map with a camera flying over it. Prints draw calls, split throughput and memory */
+	static void benchmark(float mapSize=8192, int frames=300);
+
 	/** Editing functions */
 	void updateGeometry(const BoundingBox& box, bool normals);
 
@@ -108,10 +216,11 @@ class Landscape {
 	vec3  m_position;	// Plane minimum corner position
 	float m_size;		// Plane width and height (square)
 	HeightFunc m_func;	// Height calculation callback
+	HeightBlockFunc m_blockFunc;	// Optional batched height callback
 
 	PatchFunc  m_createCallback;	// Callback when a patch is created
 	PatchFunc  m_destroyCallback;	// Callback when a patch is destroyed
-	PatchFunc  m_updateCallback;	// Callback when index array was updated
+	PatchFunc  m_updateCallback;	// Callback when vertex data was updated
 
 
 	uint  m_min, m_max;	// Patch lod limits
@@ -119,14 +228,66 @@ class Landscape {
 	uint  m_patchSize;	// Vertices in a patch (power of 2 plus 1)
 	uint  m_patchStep;	// Maxumum level step between adjacent patches (log2(patchSize-1));
 	float m_threshold;	// Error threshold in screen pixels for determining lod value
+	VertexFormat m_format;	// Patch vertex format
 	
 	Patch* m_root;					// Root patch
+	HeightTree* m_heightTree;		// Optional tree for exact ray intersection
 	GList m_geometryList;			// Output geometry
 	GList m_allGeometry;			// List of all patches
 	std::vector<Patch*> m_buildList;// Patches to update index data
 
-	std::vector<Patch*> m_splitQueue;
-	std::vector<Patch*> m_mergeQueue;
+	PatchQueue m_splitQueue;
+	PatchQueue m_mergeQueue;
+	float      m_budget;		// Split and merge time limit
+	bool       m_lodChanged;	// Leaves or settings changed since lod was calculated
+	Matrix     m_lodView;		// Camera used for last lod calculation
+	Matrix     m_lodProjection;
+	int        m_splits, m_merges;
+	float      m_updateTime, m_splitTime;
+
+	// Leaf patches mirrored as flat arrays for the per frame lod update and culling. The tree is only used for topology changes
+	enum LeafField { LEAF_MIN_X, LEAF_MIN_Y, LEAF_MIN_Z, LEAF_MAX_X, LEAF_MAX_Y, LEAF_MAX_Z, LEAF_X, LEAF_Y, LEAF_Z, LEAF_ERROR, PARENT_X, PARENT_Y, PARENT_Z, PARENT_ERROR, LEAF_FIELDS };
+	std::vector<Patch*>        m_leaves;
+	std::vector<float>         m_leafData[LEAF_FIELDS];
+	std::vector<float>         m_leafError;		// Projected errors
+	std::vector<float>         m_parentError;
+	std::vector<unsigned char> m_leafVisible;
+
+	void addLeaf(Patch*);
+	void removeLeaf(Patch*);
+	void updateLeaf(Patch*);
+	void updateLeaves(const base::Camera*);
+	void cullLeaves(const base::Camera*);
+
+	BlockPool m_patchPool;	// Patch objects
+	BlockPool m_vertexPool;	// Patch vertex arrays
+	BlockPool m_scratchPool;	// Float vertex arrays for building compact patches
+
+	// Index arrays for each combination of edge steps. Key is sum of step(edge) * (patchStep+1)^edge
+	std::vector<void*> m_indexArrays;
+	uint               m_indexCount;
+	uint               m_indexSize;	// Bytes per index
+	template<typename T> T* createIndices(uint key) const;
+	void   clearIndices();
+	Patch* createPatch(Patch* parent, int index);
+	void   destroyPatch(Patch*);
+	void   destroyTree(Patch*);
+
+	// Split patches are generated by worker threads and attached to the tree in update()
+	struct SplitJob { Patch* patch; Patch* child[4]; };
+	std::vector<SplitJob*>    m_jobs;		// Waiting for a worker
+	std::vector<SplitJob*>    m_finished;	// Generated, waiting to be attached
+	std::vector<base::Thread> m_threads;
+	std::mutex                m_jobMutex;
+	std::condition_variable   m_jobSignal;
+	bool                      m_running;
+	uint                      m_jobCount;	// Jobs not yet attached
+
+	void queueSplit(Patch*);
+	void cancelSplit(Patch*);
+	void attachFinished();
+	void stopThreads();
+	void workerThread();
 
 	const Patch* m_selected; // Debug - selected patch
 
@@ -144,13 +305,11 @@ class Patch {
 	/** Create vertex data from height function */
 	void create();	// create vertex array
 	int  split();	// split patch into four sub-patches
+	int  attach(Patch** children);	// Connect generated sub-patches
 	int  merge();	// delete sub-patches
 	void build();	// build vertex array for current lod
 	void updateEdges();
 
-	void update(const base::Camera*);
-	void collect(const base::Camera*, Landscape::GList& list, int cullFlags) const;
-
 	/** Set adjacent patch for LOD blending */
 	void setAdjacent(Patch*, int side);
 
@@ -188,30 +347,39 @@ class Patch {
 	float  m_lod;			// Current patch LOD - [0-1]
 	bool   m_split;			// Is this patch split
 	float  m_error;			// Error amount for lod
+	float  m_regionError[16];	// Error maxima of a 4x4 grid of vertex regions
 	vec3   m_corner[4];		// Patch corners
 	uint8  m_changed;		// Does the patch need reconnecting
 	uint8  m_edge[4];		// Max lod per edge (cached from children)
+	Landscape::SplitJob* m_job;	// Pending split
+	int    m_leaf;			// Index in landscape leaf arrays, -1 if split
+	int    m_splitSlot;		// Position in split queue, -1 if not queued
+	int    m_mergeSlot;		// Position in merge queue
 
 	PatchGeometry  m_geometry; // Output geometry
 
 
 	protected:
 	int getAdjacentStep(int side) const;
-	void updateEdge(int edge);	// Update edge indices to connect to neighbouring patch
+	uint getIndexKey() const;	// Edge configuration to connect to neighbouring patches
+	void getVertex(uint index, float* v) const;	// Get a vertex in float format
+	void packVertices(const float* vx, int x0, int y0, int x1, int y1);	// Write compact vertex data from float vertices
+	void fillBorder(const Rect& grid, const Rect& part, float* heights) const;	// Read source heights outside the patch into a grid
 	bool getTriangle(uint index, float lod, vec3& a, vec3& b, vec3& c) const;
 	bool intersectGeometry(const vec3& p, const vec3& d, float& t, vec3& normal) const;
 	bool intersectGeometry(const vec3& p, float radius, const vec3& d, float& t, vec3& normal) const;
 
-	float   projectError(const base::Camera* cam) const;
 	int     minLOD() const;	// Get the minimum lod level this patch can be due to adjacent patches
 	Patch*  getChild(int edge, int n) const; // get child patch n on an edge
 	int     getOppositeEdge(int edge) const;
 	int     splitAdjacent() const;
+	void    splitEdge(int side);	// Split adjacent patches along an edge that are too coarse to connect
 	void    cacheEdgeData();
 	void    flagChanged();
 	void    flagChanged(int edge);
 
-	friend class SplitCmp;	// For sorting
+	friend class PatchQueue;
+	friend class Landscape;
 };
 
 
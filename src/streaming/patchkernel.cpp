@@ -0,0 +1,511 @@
+#include "patchkernel.h"
+#include <base/math.h>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KERNEL_SSE2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KERNEL_AVX2 __attribute__((target("avx2")))
+#endif
+
+
+// The six triangles around a vertex sum to a closed form of the neighbouring heights:
+//  g0=(0,-1) g1=(1,-1) g2=(1,0) g3=(0,1) g4=(-1,1) g5=(-1,0)
+//  normal = ( stepZ*(g0-g1-2g2-g3+g4+2g5), 6*stepX*stepZ, stepX*(2g0+g1-g2-2g3-g4+g5) )
+
+static inline void normalScalar(const float* g, int gs, float sx, float sz, float& nx, float& ny, float& nz) {
+	float ax = g[-gs] - g[1-gs] - 2*g[1] - g[gs] + g[gs-1] + 2*g[-1];
+	float az = 2*g[-gs] + g[1-gs] - g[1] - 2*g[gs] - g[gs-1] + g[-1];
+	float x = sz * ax;
+	float y = 6 * sx * sz;
+	float z = sx * az;
+	float l = 1.f / sqrtf(x*x + y*y + z*z);
+	nx = x * l;
+	ny = y * l;
+	nz = z * l;
+}
+
+static inline void blendScalar(int i, int a, int b, const float* h, const float* nx, const float* ny, const float* nz, float* bh, float* bx, float* by, float* bz) {
+	float x = nx[a] + nx[b];
+	float y = ny[a] + ny[b];
+	float z = nz[a] + nz[b];
+	float l = 1.f / sqrtf(x*x + y*y + z*z);
+	bh[i] = (h[a] + h[b]) * 0.5f;
+	bx[i] = x * l;
+	by[i] = y * l;
+	bz[i] = z * l;
+}
+
+// Source vertices for a blend target. Odd columns use the adjacent columns, odd rows use the adjacent rows
+static inline void blendSource(int size, int x, int y, int& a, int& b) {
+	int odd = x & 1;
+	int ra = y & 1? y-1: y;
+	int rb = y & 1? y+1: y;
+	a = x - odd + ra * size;
+	b = x + odd + rb * size;
+}
+
+static void normalsRowScalar(const float* c, int gs, int x, int w, float sx, float sz, float* nx, float* ny, float* nz) {
+	for(; x<w; ++x) normalScalar(c + x, gs, sx, sz, nx[x], ny[x], nz[x]);
+}
+
+static void blendRowScalar(int size, int x, int x1, int y, const float* h, const float* nx, const float* ny, const float* nz, float* bh, float* bx, float* by, float* bz) {
+	int a, b;
+	for(; x<=x1; ++x) {
+		blendSource(size, x, y, a, b);
+		blendScalar(x + y*size, a, b, h, nx, ny, nz, bh, bx, by, bz);
+	}
+}
+
+
+static void projectErrorsScalar(int i, int count, const float* x, const float* y, const float* z, const float* error, const float* p, float scale, float* out) {
+	for(; i<count; ++i) {
+		float dx = x[i] - p[0];
+		float dy = y[i] - p[1];
+		float dz = z[i] - p[2];
+		out[i] = scale * error[i] / sqrtf(dx*dx + dy*dy + dz*dz);
+	}
+}
+
+// The box corner furthest along the plane normal is the only one that needs testing
+static void cullBoxesScalar(int i, int count, const float* const* bounds, const float* planes, unsigned char* out) {
+	for(; i<count; ++i) {
+		unsigned char visible = 1;
+		for(int k=0; k<6; ++k) {
+			const float* plane = planes + k*4;
+			float x = bounds[plane[0]>0? 3: 0][i];
+			float y = bounds[plane[1]>0? 4: 1][i];
+			float z = bounds[plane[2]>0? 5: 2][i];
+			if(plane[0]*x + plane[1]*y + plane[2]*z + plane[3] < 0) visible = 0;
+		}
+		out[i] = visible;
+	}
+}
+
+
+//// //// //// //// //// //// //// //// SSE2 //// //// //// //// //// //// //// ////
+
+#ifdef KERNEL_SSE2
+static void normalsSSE2(const float* heights, int w, int h, float sx, float sz, float* nx, float* ny, float* nz) {
+	const int gs = w + 2;
+	const __m128 two = _mm_set1_ps(2.f);
+	const __m128 vsx = _mm_set1_ps(sx);
+	const __m128 vsz = _mm_set1_ps(sz);
+	const __m128 vy  = _mm_set1_ps(6 * sx * sz);
+	const __m128 vy2 = _mm_mul_ps(vy, vy);
+	const __m128 one = _mm_set1_ps(1.f);
+	for(int y=0; y<h; ++y) {
+		const float* c = heights + (y+1) * gs + 1;
+		float* ox = nx + y * w;
+		float* oy = ny + y * w;
+		float* oz = nz + y * w;
+		int x = 0;
+		for(; x+4<=w; x+=4) {
+			__m128 g0 = _mm_loadu_ps(c + x - gs);
+			__m128 g1 = _mm_loadu_ps(c + x - gs + 1);
+			__m128 g2 = _mm_loadu_ps(c + x + 1);
+			__m128 g3 = _mm_loadu_ps(c + x + gs);
+			__m128 g4 = _mm_loadu_ps(c + x + gs - 1);
+			__m128 g5 = _mm_loadu_ps(c + x - 1);
+			__m128 ax = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(g0, g1), g3), _mm_sub_ps(g4, _mm_mul_ps(two, _mm_sub_ps(g2, g5))));
+			__m128 az = _mm_add_ps(_mm_sub_ps(_mm_add_ps(g1, g5), _mm_add_ps(g2, g4)), _mm_mul_ps(two, _mm_sub_ps(g0, g3)));
+			ax = _mm_mul_ps(ax, vsz);
+			az = _mm_mul_ps(az, vsx);
+			__m128 l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, ax), _mm_mul_ps(az, az)), vy2);
+			l = _mm_div_ps(one, _mm_sqrt_ps(l));
+			_mm_storeu_ps(ox + x, _mm_mul_ps(ax, l));
+			_mm_storeu_ps(oy + x, _mm_mul_ps(vy, l));
+			_mm_storeu_ps(oz + x, _mm_mul_ps(az, l));
+		}
+		normalsRowScalar(c, gs, x, w, sx, sz, ox, oy, oz);
+	}
+}
+
+static inline __m128 selectSSE2(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static void blendSSE2(int size, int x0, int y0, int x1, int y1, const float* h, const float* nx, const float* ny, const float* nz, float* bh, float* bx, float* by, float* bz) {
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 oddLanes[2] = { _mm_castsi128_ps(_mm_set_epi32(-1,0,-1,0)), _mm_castsi128_ps(_mm_set_epi32(0,-1,0,-1)) };
+	// Vector loop needs x-1 and x+4 inside the row
+	const int first = x0 > 1? x0: 1;
+	const int last = (x1 < size-2? x1: size-2) - 3;
+	for(int y=y0; y<=y1; ++y) {
+		const int ra = (y & 1? y-1: y) * size;
+		const int rb = (y & 1? y+1: y) * size;
+		const int row = y * size;
+		blendRowScalar(size, x0, first-1, y, h, nx, ny, nz, bh, bx, by, bz);
+		int x = first;
+		for(; x<=last; x+=4) {
+			__m128 mask = oddLanes[x&1];
+			#define SOURCE(array, out) \
+				__m128 out = _mm_add_ps(selectSSE2(mask, _mm_loadu_ps(array+ra+x-1), _mm_loadu_ps(array+ra+x)), \
+				                        selectSSE2(mask, _mm_loadu_ps(array+rb+x+1), _mm_loadu_ps(array+rb+x)))
+			SOURCE(h, sh);
+			SOURCE(nx, sx);
+			SOURCE(ny, sy);
+			SOURCE(nz, sz);
+			#undef SOURCE
+			__m128 l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), _mm_mul_ps(sz, sz));
+			l = _mm_div_ps(one, _mm_sqrt_ps(l));
+			_mm_storeu_ps(bh + row + x, _mm_mul_ps(sh, half));
+			_mm_storeu_ps(bx + row + x, _mm_mul_ps(sx, l));
+			_mm_storeu_ps(by + row + x, _mm_mul_ps(sy, l));
+			_mm_storeu_ps(bz + row + x, _mm_mul_ps(sz, l));
+		}
+		blendRowScalar(size, x > x0? x: x0, x1, y, h, nx, ny, nz, bh, bx, by, bz);
+	}
+}
+
+static void projectErrorsSSE2(int count, const float* x, const float* y, const float* z, const float* error, const float* p, float scale, float* out) {
+	const __m128 px = _mm_set1_ps(p[0]);
+	const __m128 py = _mm_set1_ps(p[1]);
+	const __m128 pz = _mm_set1_ps(p[2]);
+	const __m128 s = _mm_set1_ps(scale);
+	int i = 0;
+	for(; i+4<=count; i+=4) {
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(x+i), px);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(y+i), py);
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(z+i), pz);
+		__m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+		_mm_storeu_ps(out+i, _mm_div_ps(_mm_mul_ps(s, _mm_loadu_ps(error+i)), d));
+	}
+	projectErrorsScalar(i, count, x, y, z, error, p, scale, out);
+}
+
+static void cullBoxesSSE2(int count, const float* const* bounds, const float* planes, unsigned char* out) {
+	const float* corner[6][3];
+	__m128 plane[6][4];
+	for(int k=0; k<6; ++k) {
+		for(int j=0; j<3; ++j) corner[k][j] = bounds[planes[k*4+j]>0? j+3: j];
+		for(int j=0; j<4; ++j) plane[k][j] = _mm_set1_ps(planes[k*4+j]);
+	}
+	const __m128 zero = _mm_setzero_ps();
+	int i = 0;
+	for(; i+4<=count; i+=4) {
+		__m128 outside = zero;
+		for(int k=0; k<6; ++k) {
+			__m128 d = _mm_add_ps(_mm_mul_ps(plane[k][0], _mm_loadu_ps(corner[k][0]+i)), plane[k][3]);
+			d = _mm_add_ps(d, _mm_mul_ps(plane[k][1], _mm_loadu_ps(corner[k][1]+i)));
+			d = _mm_add_ps(d, _mm_mul_ps(plane[k][2], _mm_loadu_ps(corner[k][2]+i)));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(d, zero));
+		}
+		int mask = _mm_movemask_ps(outside);
+		for(int j=0; j<4; ++j) out[i+j] = (mask >> j & 1) ^ 1;
+	}
+	cullBoxesScalar(i, count, bounds, planes, out);
+}
+#endif
+
+
+//// //// //// //// //// //// //// //// AVX2 //// //// //// //// //// //// //// ////
+
+#ifdef KERNEL_AVX2
+KERNEL_AVX2 static void normalsAVX2(const float* heights, int w, int h, float sx, float sz, float* nx, float* ny, float* nz) {
+	const int gs = w + 2;
+	const __m256 two = _mm256_set1_ps(2.f);
+	const __m256 vsx = _mm256_set1_ps(sx);
+	const __m256 vsz = _mm256_set1_ps(sz);
+	const __m256 vy  = _mm256_set1_ps(6 * sx * sz);
+	const __m256 vy2 = _mm256_mul_ps(vy, vy);
+	const __m256 one = _mm256_set1_ps(1.f);
+	for(int y=0; y<h; ++y) {
+		const float* c = heights + (y+1) * gs + 1;
+		float* ox = nx + y * w;
+		float* oy = ny + y * w;
+		float* oz = nz + y * w;
+		int x = 0;
+		for(; x+8<=w; x+=8) {
+			__m256 g0 = _mm256_loadu_ps(c + x - gs);
+			__m256 g1 = _mm256_loadu_ps(c + x - gs + 1);
+			__m256 g2 = _mm256_loadu_ps(c + x + 1);
+			__m256 g3 = _mm256_loadu_ps(c + x + gs);
+			__m256 g4 = _mm256_loadu_ps(c + x + gs - 1);
+			__m256 g5 = _mm256_loadu_ps(c + x - 1);
+			__m256 ax = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(g0, g1), g3), _mm256_sub_ps(g4, _mm256_mul_ps(two, _mm256_sub_ps(g2, g5))));
+			__m256 az = _mm256_add_ps(_mm256_sub_ps(_mm256_add_ps(g1, g5), _mm256_add_ps(g2, g4)), _mm256_mul_ps(two, _mm256_sub_ps(g0, g3)));
+			ax = _mm256_mul_ps(ax, vsz);
+			az = _mm256_mul_ps(az, vsx);
+			__m256 l = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, ax), _mm256_mul_ps(az, az)), vy2);
+			l = _mm256_div_ps(one, _mm256_sqrt_ps(l));
+			_mm256_storeu_ps(ox + x, _mm256_mul_ps(ax, l));
+			_mm256_storeu_ps(oy + x, _mm256_mul_ps(vy, l));
+			_mm256_storeu_ps(oz + x, _mm256_mul_ps(az, l));
+		}
+		normalsRowScalar(c, gs, x, w, sx, sz, ox, oy, oz);
+	}
+}
+
+KERNEL_AVX2 static void blendAVX2(int size, int x0, int y0, int x1, int y1, const float* h, const float* nx, const float* ny, const float* nz, float* bh, float* bx, float* by, float* bz) {
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256 oddLanes[2] = { _mm256_castsi256_ps(_mm256_set_epi32(-1,0,-1,0,-1,0,-1,0)), _mm256_castsi256_ps(_mm256_set_epi32(0,-1,0,-1,0,-1,0,-1)) };
+	const int first = x0 > 1? x0: 1;
+	const int last = (x1 < size-2? x1: size-2) - 7;
+	for(int y=y0; y<=y1; ++y) {
+		const int ra = (y & 1? y-1: y) * size;
+		const int rb = (y & 1? y+1: y) * size;
+		const int row = y * size;
+		blendRowScalar(size, x0, first-1, y, h, nx, ny, nz, bh, bx, by, bz);
+		int x = first;
+		for(; x<=last; x+=8) {
+			__m256 mask = oddLanes[x&1];
+			#define SOURCE(array, out) \
+				__m256 out = _mm256_add_ps(_mm256_blendv_ps(_mm256_loadu_ps(array+ra+x), _mm256_loadu_ps(array+ra+x-1), mask), \
+				                           _mm256_blendv_ps(_mm256_loadu_ps(array+rb+x), _mm256_loadu_ps(array+rb+x+1), mask))
+			SOURCE(h, sh);
+			SOURCE(nx, sx);
+			SOURCE(ny, sy);
+			SOURCE(nz, sz);
+			#undef SOURCE
+			__m256 l = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz));
+			l = _mm256_div_ps(one, _mm256_sqrt_ps(l));
+			_mm256_storeu_ps(bh + row + x, _mm256_mul_ps(sh, half));
+			_mm256_storeu_ps(bx + row + x, _mm256_mul_ps(sx, l));
+			_mm256_storeu_ps(by + row + x, _mm256_mul_ps(sy, l));
+			_mm256_storeu_ps(bz + row + x, _mm256_mul_ps(sz, l));
+		}
+		blendRowScalar(size, x > x0? x: x0, x1, y, h, nx, ny, nz, bh, bx, by, bz);
+	}
+}
+
+KERNEL_AVX2 static void projectErrorsAVX2(int count, const float* x, const float* y, const float* z, const float* error, const float* p, float scale, float* out) {
+	const __m256 px = _mm256_set1_ps(p[0]);
+	const __m256 py = _mm256_set1_ps(p[1]);
+	const __m256 pz = _mm256_set1_ps(p[2]);
+	const __m256 s = _mm256_set1_ps(scale);
+	int i = 0;
+	for(; i+8<=count; i+=8) {
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x+i), px);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y+i), py);
+		__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z+i), pz);
+		__m256 d = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+		_mm256_storeu_ps(out+i, _mm256_div_ps(_mm256_mul_ps(s, _mm256_loadu_ps(error+i)), d));
+	}
+	projectErrorsScalar(i, count, x, y, z, error, p, scale, out);
+}
+
+KERNEL_AVX2 static void cullBoxesAVX2(int count, const float* const* bounds, const float* planes, unsigned char* out) {
+	const float* corner[6][3];
+	__m256 plane[6][4];
+	for(int k=0; k<6; ++k) {
+		for(int j=0; j<3; ++j) corner[k][j] = bounds[planes[k*4+j]>0? j+3: j];
+		for(int j=0; j<4; ++j) plane[k][j] = _mm256_set1_ps(planes[k*4+j]);
+	}
+	const __m256 zero = _mm256_setzero_ps();
+	int i = 0;
+	for(; i+8<=count; i+=8) {
+		__m256 outside = zero;
+		for(int k=0; k<6; ++k) {
+			__m256 d = _mm256_add_ps(_mm256_mul_ps(plane[k][0], _mm256_loadu_ps(corner[k][0]+i)), plane[k][3]);
+			d = _mm256_add_ps(d, _mm256_mul_ps(plane[k][1], _mm256_loadu_ps(corner[k][1]+i)));
+			d = _mm256_add_ps(d, _mm256_mul_ps(plane[k][2], _mm256_loadu_ps(corner[k][2]+i)));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(d, zero, _CMP_LT_OQ));
+		}
+		int mask = _mm256_movemask_ps(outside);
+		for(int j=0; j<8; ++j) out[i+j] = (mask >> j & 1) ^ 1;
+	}
+	cullBoxesScalar(i, count, bounds, planes, out);
+}
+#endif
+
+
+//// //// //// //// //// //// //// //// Dispatch //// //// //// //// //// //// //// ////
+
+static PatchKernel::Level detectLevel() {
+	#ifdef KERNEL_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return PatchKernel::AVX2;
+	#endif
+	#ifdef KERNEL_SSE2
+	return PatchKernel::SSE2;
+	#else
+	return PatchKernel::SCALAR;
+	#endif
+}
+
+PatchKernel::Level PatchKernel::getLevel() {
+	static const Level level = detectLevel();
+	return level;
+}
+
+void PatchKernel::normals(const float* heights, int w, int h, float sx, float sz, float* nx, float* ny, float* nz) {
+	normals(getLevel(), heights, w, h, sx, sz, nx, ny, nz);
+}
+
+void PatchKernel::blend(int size, int x0, int y0, int x1, int y1, const float* h, const float* nx, const float* ny, const float* nz, float* bh, float* bx, float* by, float* bz) {
+	blend(getLevel(), size, x0, y0, x1, y1, h, nx, ny, nz, bh, bx, by, bz);
+}
+
+void PatchKernel::projectErrors(int count, const float* x, const float* y, const float* z, const float* error, const float* point, float scale, float* out) {
+	projectErrors(getLevel(), count, x, y, z, error, point, scale, out);
+}
+
+void PatchKernel::cullBoxes(int count, const float* const* bounds, const float* planes, unsigned char* out) {
+	cullBoxes(getLevel(), count, bounds, planes, out);
+}
+
+void PatchKernel::normals(Level level, const float* heights, int w, int h, float sx, float sz, float* nx, float* ny, float* nz) {
+	switch(level) {
+	#ifdef KERNEL_AVX2
+	case AVX2: normalsAVX2(heights, w, h, sx, sz, nx, ny, nz); break;
+	#endif
+	#ifdef KERNEL_SSE2
+	case SSE2: normalsSSE2(heights, w, h, sx, sz, nx, ny, nz); break;
+	#endif
+	default:
+		for(int y=0; y<h; ++y) normalsRowScalar(heights + (y+1)*(w+2) + 1, w+2, 0, w, sx, sz, nx+y*w, ny+y*w, nz+y*w);
+		break;
+	}
+}
+
+void PatchKernel::blend(Level level, int size, int x0, int y0, int x1, int y1, const float* h, const float* nx, const float* ny, const float* nz, float* bh, float* bx, float* by, float* bz) {
+	switch(level) {
+	#ifdef KERNEL_AVX2
+	case AVX2: blendAVX2(size, x0, y0, x1, y1, h, nx, ny, nz, bh, bx, by, bz); break;
+	#endif
+	#ifdef KERNEL_SSE2
+	case SSE2: blendSSE2(size, x0, y0, x1, y1, h, nx, ny, nz, bh, bx, by, bz); break;
+	#endif
+	default:
+		for(int y=y0; y<=y1; ++y) blendRowScalar(size, x0, x1, y, h, nx, ny, nz, bh, bx, by, bz);
+		break;
+	}
+}
+
+
+void PatchKernel::projectErrors(Level level, int count, const float* x, const float* y, const float* z, const float* error, const float* point, float scale, float* out) {
+	switch(level) {
+	#ifdef KERNEL_AVX2
+	case AVX2: projectErrorsAVX2(count, x, y, z, error, point, scale, out); break;
+	#endif
+	#ifdef KERNEL_SSE2
+	case SSE2: projectErrorsSSE2(count, x, y, z, error, point, scale, out); break;
+	#endif
+	default: projectErrorsScalar(0, count, x, y, z, error, point, scale, out); break;
+	}
+}
+
+void PatchKernel::cullBoxes(Level level, int count, const float* const* bounds, const float* planes, unsigned char* out) {
+	switch(level) {
+	#ifdef KERNEL_AVX2
+	case AVX2: cullBoxesAVX2(count, bounds, planes, out); break;
+	#endif
+	#ifdef KERNEL_SSE2
+	case SSE2: cullBoxesSSE2(count, bounds, planes, out); break;
+	#endif
+	default: cullBoxesScalar(0, count, bounds, planes, out); break;
+	}
+}
+
+
+//// //// //// //// //// //// //// //// Benchmark //// //// //// //// //// //// //// ////
+
+// Original per-vertex normal and interpolation passes from Patch::create for comparison
+static void referencePatch(const float* heights, int size, float step, float* vx) {
+	const int stride = 10;
+	const int gs = size + 2;
+	vec3 n[6], normal;
+	static const vec3 base[6] = { vec3(0,0,-1), vec3(1,0,-1), vec3(1,0,0), vec3(0,0,1), vec3(-1,0,1), vec3(-1,0,0) };
+	for(int i=0; i<6; ++i) n[i] = base[i] * step;
+	for(int x=0; x<size; ++x) {
+		for(int y=0; y<size; ++y) {
+			float* v = vx + (x+y*size)*stride;
+			const float* g = heights + x+1 + (y+1)*gs;
+			float h = *g;
+			v[1] = v[9] = h;
+			n[0].y = g[-gs]   - h;
+			n[1].y = g[1-gs]  - h;
+			n[2].y = g[1]     - h;
+			n[3].y = g[gs]    - h;
+			n[4].y = g[gs-1]  - h;
+			n[5].y = g[-1]    - h;
+			normal.x = normal.y = normal.z = 0;
+			for(int i=0; i<6; ++i) normal += n[i].cross( n[(i+1)%6] );
+			normal.normalise();
+			v[3] = -normal.x;
+			v[4] = -normal.y;
+			v[5] = -normal.z;
+		}
+	}
+	for(int x=0; x<size; ++x) {
+		for(int y=0; y<size; ++y) {
+			float* v = vx + (x + y*size)*stride;
+			float* a=0;
+			float* b=0;
+			if((x&1) && (y&1)) {
+				a = vx + (x-1 + (y-1)*size) * stride;
+				b = vx + (x+1 + (y+1)*size) * stride;
+			} else if(x&1) {
+				a = vx + (x-1 + y*size) * stride;
+				b = vx + (x+1 + y*size) * stride;
+			} else if(y&1) {
+				a = vx + (x + (y-1)*size) * stride;
+				b = vx + (x + (y+1)*size) * stride;
+			}
+			if(a&&b) {
+				vec3 n = (vec3(a+3) + vec3(b+3)).normalise();
+				v[6] = n.x;
+				v[7] = n.y;
+				v[8] = n.z;
+				v[9] = (a[1] + b[1]) * 0.5;
+			} else {
+				memcpy(v+6, v+3, 3*sizeof(float));
+			}
+		}
+	}
+}
+
+void PatchKernel::benchmark(int size, int iterations) {
+	typedef std::chrono::high_resolution_clock Clock;
+	const int gs = size + 2;
+	const int count = size * size;
+	const float step = 4.f;
+	float* heights = new float[gs * gs];
+	for(int i=0; i<gs*gs; ++i) heights[i] = 20 * sinf(i * 0.37f) + 5 * cosf(i * 1.3f);
+
+	float* reference = new float[count * 10];
+	float* planar = new float[count * 8];
+	float* h = planar;
+	float* n = planar + count;
+	float* b = planar + count * 4;
+	for(int y=0; y<size; ++y) memcpy(h + y*size, heights + (y+1)*gs + 1, size*sizeof(float));
+
+	Clock::time_point start = Clock::now();
+	for(int i=0; i<iterations; ++i) referencePatch(heights, size, step, reference);
+	double base = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations / count;
+	printf("Patch kernel %dx%d: original %.2f ns/vertex\n", size, size, base);
+
+	static const char* names[] = { "scalar", "sse2", "avx2" };
+	for(int level=SCALAR; level<=getLevel(); ++level) {
+		start = Clock::now();
+		for(int i=0; i<iterations; ++i) {
+			normals((Level)level, heights, size, size, step, step, n, n+count, n+count*2);
+			blend((Level)level, size, 0, 0, size-1, size-1, h, n, n+count, n+count*2, b+count*3, b, b+count, b+count*2);
+		}
+		double t = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations / count;
+
+		float error = 0;
+		for(int i=0; i<count; ++i) {
+			const float* r = reference + i*10;
+			for(int k=0; k<3; ++k) error = fmax(error, fabs(r[3+k] - n[i + k*count]));
+			for(int k=0; k<3; ++k) error = fmax(error, fabs(r[6+k] - b[i + k*count]));
+			error = fmax(error, fabs(r[9] - b[i + count*3]));
+		}
+		printf("  %-6s %.2f ns/vertex  x%.1f  max error %g\n", names[level], t, base / t, error);
+	}
+
+	delete [] heights;
+	delete [] reference;
+	delete [] planar;
+}
+
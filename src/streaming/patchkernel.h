@@ -0,0 +1,38 @@
+#pragma once
+
+/** Vectorised vertex, error projection and culling calculations for landscape patches.
+ *  Uses AVX2 if the cpu supports it, SSE2 on x86, otherwise scalar code. All arrays are planar */
+class PatchKernel {
+	public:
+	enum Level { SCALAR, SSE2, AVX2 };
+
+	/** Get the best instruction set available */
+	static Level getLevel();
+
+	/** Normals from a height grid with a one sample border. heights is (w+2)*(h+2) with a row pitch of w+2.
+	 *  Output arrays are w*h. Same result as summing the six triangle normals around each vertex */
+	static void normals(const float* heights, int w, int h, float stepX, float stepZ, float* nx, float* ny, float* nz);
+
+	/** Lod blend targets of a square patch. Each vertex is the average of the two coarser lod vertices
+	 *  it lies between. Updates columns x0-x1 and rows y0-y1 inclusive. All arrays are size*size */
+	static void blend(int size, int x0, int y0, int x1, int y1,
+	                  const float* height, const float* nx, const float* ny, const float* nz,
+	                  float* blendHeight, float* bx, float* by, float* bz);
+
+	/** Projected screen error of each patch: scale * error / distance from point to centre */
+	static void projectErrors(int count, const float* x, const float* y, const float* z, const float* error, const float* point, float scale, float* out);
+
+	/** Frustum test of axis aligned boxes. planes are six (a,b,c,d) with the inside positive.
+	 *  bounds is six arrays: min x,y,z then max x,y,z. Sets out to 1 if the box is not outside any plane */
+	static void cullBoxes(int count, const float* const* bounds, const float* planes, unsigned char* out);
+
+	/** Time the kernels against the original per-vertex code and print the results */
+	static void benchmark(int size=33, int iterations=2000);
+
+	protected:
+	static void normals(Level, const float*, int, int, float, float, float*, float*, float*);
+	static void blend(Level, int, int, int, int, int, const float*, const float*, const float*, const float*, float*, float*, float*, float*);
+	static void projectErrors(Level, int, const float*, const float*, const float*, const float*, const float*, float, float*);
+	static void cullBoxes(Level, int, const float* const*, const float*, unsigned char*);
+};
+
@@ -14,8 +14,11 @@
 
 
 Streamer::Streamer(float hs) : m_heightScale(hs), m_land(0), m_drawable(0), m_material(0) {
-	setBufferSize(256, 256);
 	m_encode = m_decode = 0;
+	m_patchSize = 9;
+	m_prefetchRadius = 256;
+	m_prefetchFrames = 30;
+	m_lastPrefetch = Point(0x7fffffff, 0);
 }
 
 Streamer::~Streamer() {
@@ -24,26 +27,35 @@ Streamer::~Streamer() {
 
 void Streamer::streamOpened() {
 	// Setup landscape from stream data
-	int p = 0;
+	int p = 0, step = 0;
 	int size = m_stream->width() & ~1;
 	int scale = (1 << m_stream->bpp()) - 1;
 	m_decode = m_heightScale / scale;
 	m_encode = scale / m_heightScale;
 	while((1<<p) < size) ++p;
+	while((1<<step) < m_patchSize-1) ++step;
 	m_offset = vec3(-size/2, 0, -size/2);
-	s_streamer = this;
 	m_land = new Landscape(size, m_offset);
-	m_land->setLimits(0, p-3);
-	m_land->setPatchCallbacks( bind(Streamer::patchCreated), bind(Streamer::patchDestroyed), 0);
-	m_land->setHeightFunction( bind(Streamer::heightFunc) );
-	m_drawable = new StreamerDrawable(m_land);
+	m_land->setPatchSize(m_patchSize);
+	m_land->setLimits(0, p-step);
+	m_land->setVertexFormat(Landscape::COMPACT_VERTICES);
+	m_land->setPatchCallbacks( bind(this, &Streamer::patchCreated), bind(this, &Streamer::patchDestroyed), bind(this, &Streamer::patchUpdated) );
+	m_land->setHeightFunction( bind(this, &Streamer::heightFunc), bind(this, &Streamer::heightBlockFunc) );
+	m_land->createHeightTree(1, false);	// Reading the whole stream is too slow
+	m_land->setThreads(2);	// Stream reads are locked
+	m_drawable = new StreamerDrawable(this, m_land);
 	attach(m_drawable);
+	startPrefetchThread();
 }
 
 void Streamer::closeStream() {
-	BufferedStream::closeStream();
+	// Landscape worker threads read the stream
 	if(m_land) delete m_land;
-	if(s_streamer==this) s_streamer=0;
+	for(std::map<uint, base::HardwareIndexBuffer*>::iterator i=m_indexBuffers.begin(); i!=m_indexBuffers.end(); ++i) {
+		i->second->dropReference();
+	}
+	m_indexBuffers.clear();
+	BufferedStream::closeStream();
 	deleteAttachments();
 	m_land = 0;
 }
@@ -52,6 +64,32 @@ void Streamer::setLod(float value) {
 	if(m_land) m_land->setThreshold(value);
 }
 
+void Streamer::setPrefetch(int radius, float frames) {
+	m_prefetchRadius = radius;
+	m_prefetchFrames = frames;
+}
+
+void Streamer::updatePrefetch(const vec3& camera) {
+	// Predict camera position from its movement last frame
+	vec3 velocity = camera - m_lastCamera;
+	m_lastCamera = camera;
+	if(velocity.length() > m_prefetchRadius) velocity = vec3();	// Teleported
+	vec3 current = camera - m_offset;
+	vec3 future = current + velocity * m_prefetchFrames;
+
+	// Only send a new request when the predicted block changes
+	int r = m_prefetchRadius;
+	Point block(floor(future.x / m_blockSize), floor(future.z / m_blockSize));
+	if(block == m_lastPrefetch) return;
+	m_lastPrefetch = block;
+
+	// Area around predicted position first, then the path to it
+	Rect rects[2];
+	rects[0].set(future.x-r, future.z-r, 2*r, 2*r);
+	rects[1].set(fmin(current.x, future.x)-r, fmin(current.z, future.z)-r, fabs(future.x-current.x)+2*r, fabs(future.z-current.z)+2*r);
+	requestPrefetch(rects, 2);
+}
+
 void Streamer::setMaterial(const DynamicMaterial* m) {
 	float size = m_stream->width() & ~1;
 	m_material = m->getStream();
@@ -60,7 +98,7 @@ void Streamer::setMaterial(const DynamicMaterial* m) {
 	// Change materials in existing patches
 	GL_CHECK_ERROR;
 	m_swapMaterialFlag = true;
-	int r = m_land->visitAllPatches( bind(Streamer::updatePatchMaterial) );
+	int r = m_land->visitAllPatches( bind(this, &Streamer::updatePatchMaterial) );
 	printf("%d patches visited\n", r);
 	m_swapMaterialFlag = false;
 	GL_CHECK_ERROR;
@@ -78,92 +116,179 @@ void Streamer::addTexture(const char* name, const Texture& tex) {
 
 struct PatchTag {
 	Material* material;
+	base::HardwareVertexBuffer* vertexBuffer;
 };
 
 
-Streamer* Streamer::s_streamer = 0;
 float Streamer::heightFunc(const vec3& p) {
-	int x = p.x - s_streamer->m_offset.x;
-	int y = p.z - s_streamer->m_offset.z;
-	if(x<0 || y<0 || x>=s_streamer->width() || y>=s_streamer->height()) return 0;
+	int x = p.x - m_offset.x;
+	int y = p.z - m_offset.z;
+	if(x<0 || y<0 || x>=width() || y>=height()) return 0;
 	uint16 pixel;
-	s_streamer->getPixel(x, y, &pixel);
-	return pixel * s_streamer->m_decode;
+	getPixel(x, y, &pixel);
+	return pixel * m_decode;
+}
+void Streamer::heightBlockFunc(const vec3& origin, float step, const Rect& r, float* out) {
+	// Samples must lie on pixels to read them as a block
+	float x = origin.x - m_offset.x + r.x * step;
+	float z = origin.z - m_offset.z + r.y * step;
+	if(step<1 || step!=floor(step) || x!=floor(x) || z!=floor(z)) {
+		for(int j=0; j<r.height; ++j) for(int i=0; i<r.width; ++i) {
+			*out++ = heightFunc( origin + vec3((r.x+i)*step, 0, (r.y+j)*step) );
+		}
+		return;
+	}
+	int count = r.width * r.height;
+	uint16* data = new uint16[count];
+	getSamples(x, z, step, r.width, r.height, data);
+	for(int i=0; i<count; ++i) out[i] = data[i] * m_decode;
+	delete [] data;
 }
 void Streamer::patchCreated(PatchGeometry* g) {
 	PatchTag* tag = new PatchTag;
 	tag->material = 0;
 	g->tag = tag;
+
+	// Geometry stays on the gpu until the patch changes
+	tag->vertexBuffer = new base::HardwareVertexBuffer();
+	if(g->compact) {
+		tag->vertexBuffer->attributes.add(base::VA_VERTEX, base::VA_FLOAT3); // Packed shorts decoded in the shader - sets the stride
+		tag->vertexBuffer->setData(g->compact, g->vertexCount, sizeof(CompactVertex));
+	}
+	else {
+		tag->vertexBuffer->attributes.add(base::VA_VERTEX, base::VA_FLOAT3);
+		tag->vertexBuffer->attributes.add(base::VA_NORMAL, base::VA_FLOAT3);
+		tag->vertexBuffer->attributes.add(base::VA_TANGENT, base::VA_FLOAT4); // normal2,height2 - pads out the stride
+		tag->vertexBuffer->setData(g->vertices, g->vertexCount, 10*sizeof(float));
+	}
+	tag->vertexBuffer->createBuffer();
+	tag->vertexBuffer->addReference();
+}
+void Streamer::patchUpdated(PatchGeometry* g) {
+	PatchTag* tag = static_cast<PatchTag*>(g->tag);
+	if(!tag) return;
+	if(g->compact) tag->vertexBuffer->setData(g->compact, g->vertexCount, sizeof(CompactVertex));
+	else tag->vertexBuffer->setData(g->vertices, g->vertexCount, 10*sizeof(float));
 }
 void Streamer::patchDestroyed(PatchGeometry* g) {
 	PatchTag* tag = static_cast<PatchTag*>(g->tag);
-	s_streamer->m_material->dropMaterial( tag->material );
+	if(m_material) m_material->dropMaterial( tag->material );
+	tag->vertexBuffer->dropReference();
 	delete tag;
 	g->tag = 0;
 }
 
 
-vec3 lodCameraPosition;
+base::HardwareIndexBuffer* Streamer::getIndexBuffer(const PatchGeometry* g) {
+	base::HardwareIndexBuffer*& buffer = m_indexBuffers[g->indexKey];
+	if(!buffer) {
+		if(g->indexSize==4) {
+			buffer = new base::HardwareIndexBuffer(32);
+			buffer->setData(static_cast<const uint*>(g->indices), g->indexCount);
+		}
+		else {
+			buffer = new base::HardwareIndexBuffer(16);
+			buffer->setData(static_cast<const uint16*>(g->indices), g->indexCount);
+		}
+		buffer->createBuffer();
+		buffer->addReference();
+	}
+	return buffer;
+}
+
 void Streamer::updatePatchMaterial(PatchGeometry* g) {
 	PatchTag* tag = static_cast<PatchTag*>(g->tag);
+	if(!m_material) return;
 	// Switch material lod
-	vec3 cp = g->bounds->clamp( lodCameraPosition );
-	float d = lodCameraPosition.distance2(cp);
-	Material* global = s_streamer&&s_streamer->m_material? s_streamer->m_material->getGlobal(): 0;
+	vec3 cp = g->bounds->clamp( m_lodCameraPosition );
+	float d = m_lodCameraPosition.distance2(cp);
+	Material* global = m_material->getGlobal();
 
-	if(g->bounds->size().x > -s_streamer->m_offset.x * 0.5) d = 1e20f;
+	if(g->bounds->size().x > -m_offset.x * 0.5) d = 1e20f;
 
-	if(d > 1000 * 1000 || s_streamer->m_swapMaterialFlag) {
+	if(d > 1000 * 1000 || m_swapMaterialFlag) {
 		// May need to drop reference
-		if(tag->material != global) s_streamer->m_material->dropMaterial( tag->material );
+		if(tag->material != global) m_material->dropMaterial( tag->material );
 		tag->material = global;
 	}
 	else if(tag->material == 0 || tag->material == global) {
-		vec2 offset = s_streamer->m_offset.xz();
+		vec2 offset = m_offset.xz();
 		vec2 size = offset * -2.0;
-		int div = s_streamer->m_material->getDivisions();
-		vec2 index = (g->bounds->centre() - s_streamer->m_offset).xz() * div / size;
-		Material* m = s_streamer->m_material->getMaterial( (int)index.x, (int)index.y);
+		int div = m_material->getDivisions();
+		vec2 index = (g->bounds->centre() - m_offset).xz() * div / size;
+		Material* m = m_material->getMaterial( (int)index.x, (int)index.y);
 		tag->material = m;
 	}
 }
 
 
+void Streamer::updateMaterials(const vec3& cameraPosition) {
+	m_lodCameraPosition = cameraPosition;
+	if(m_material) m_material->update();
+	m_land->visitAllPatches( bind(this, &Streamer::updatePatchMaterial) );
+}
+
+
 // ========================================================================================= //
 
-StreamerDrawable::StreamerDrawable(Landscape* land) : m_land(land) {}
+StreamerDrawable::StreamerDrawable(Streamer* s, Landscape* land) : m_land(land), m_streamer(s) {}
 void StreamerDrawable::draw( base::RenderState& r) {
 	// Update terrain lod stuff - Note: only needs to be called one per frame
-	lodCameraPosition = r.getCamera()->getPosition();
+	m_streamer->updatePrefetch( r.getCamera()->getPosition() );
 	m_land->update( r.getCamera() );
-	m_land->visitAllPatches( ::bind(Streamer::updatePatchMaterial) );
+	m_streamer->updateMaterials( r.getCamera()->getPosition() );
 
 	// View frustum culling
 	m_land->cull( r.getCamera() );
 
-	// ToDo: use PatchGeometry tag property to store vertex buffer objects
-	static base::HardwareIndexBuffer ti;
-	static base::HardwareVertexBuffer tv;
-	ti.bind();
-	tv.bind();
-
-	const int stride = 10 * sizeof(float);
+	// Draw from per-patch vertex buffers. Index buffers are shared by edge configuration
+	const bool compact = m_land->getVertexFormat() == Landscape::COMPACT_VERTICES;
+	const int  stride = compact? sizeof(CompactVertex): 10 * sizeof(float);
+	const int  size = m_land->getPatchSize();
+	// Uniforms are looked up when the material changes. Relinking a shader can move them
+	Material* material = 0;
+	GLint program = 0, patchOrigin = -1, patchInfo = -1;
 	for(uint i=0; i<m_land->getGeometry().size(); ++i) {
 		const PatchGeometry* g = m_land->getGeometry()[i];
 		const PatchTag* tag = static_cast<const PatchTag*>(g->tag);
-
-		r.setMaterial( tag->material );
-		base::Shader::current().setAttributePointer(0, 3, GL_FLOAT, stride, base::SA_FLOAT, g->vertices);
-		base::Shader::current().setAttributePointer(1, 3, GL_FLOAT, stride, base::SA_FLOAT, g->vertices+3);
-		glDrawElements(GL_TRIANGLE_STRIP, g->indexCount, GL_UNSIGNED_SHORT, g->indices);
+		base::HardwareIndexBuffer* indices = m_streamer->getIndexBuffer(g);
+
+		if(tag->material != material) {
+			// Materials are shared with float vertex heightmaps, which expect patchInfo to be zero
+			if(compact && material) glUniform2f(patchInfo, 0, 0);
+			material = tag->material;
+			r.setMaterial( material );
+			if(compact) {
+				GLint current = 0;
+				glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+				if(current != program) {
+					program = current;
+					patchOrigin = glGetUniformLocation(program, "patchOrigin");
+					patchInfo = glGetUniformLocation(program, "patchInfo");
+				}
+			}
+		}
+		tag->vertexBuffer->bind();
+		indices->bind();
+		if(compact) {
+			// Vertex shader rebuilds positions from the vertex index and patch bounds
+			const BoundingBox& b = *g->bounds;
+			glUniform4f(patchOrigin, b.min.x, g->heightOffset, b.min.z, (b.max.x - b.min.x) / (size-1));
+			glUniform2f(patchInfo, g->heightScale, size);
+			base::Shader::current().setAttributePointer(0, 2, GL_UNSIGNED_SHORT, stride, base::SA_FLOAT, 0);
+			base::Shader::current().setAttributePointer(1, 4, GL_SHORT, stride, base::SA_FLOAT, (void*)(2*sizeof(uint16)));
+		}
+		else {
+			base::Shader::current().setAttributePointer(0, 3, GL_FLOAT, stride, base::SA_FLOAT, 0);
+			base::Shader::current().setAttributePointer(1, 3, GL_FLOAT, stride, base::SA_FLOAT, (void*)(3*sizeof(float)));
+		}
+		glDrawElements(GL_TRIANGLE_STRIP, g->indexCount, indices->getDataType(), 0);
 	}
+	if(compact && material) glUniform2f(patchInfo, 0, 0);
 }
 
 // ========================================================================================= //
 
-static ubyte* s_buffer = 0;
-static Rect  s_rect;
-
 inline uint16 clamp16(float v) { return v<0? 0: v>65535? 65535: v; }
 
 int StreamingHeightmapEditor::getHeights(const Rect& r, float* array) const {
@@ -187,8 +312,6 @@ int StreamingHeightmapEditor::setHeights(const Rect& r, const float* array) {
 	BoundingBox box(r.left(), 0, r.top(), r.right(), 0, r.bottom());
 	box += m_map->m_offset;
 	m_map->m_land->updateGeometry( box, true );
-	s_buffer = m_map->m_buffer;
-	s_rect = m_map->m_bufferRect;
 	return 1;
 }
 
@@ -14,13 +14,16 @@ class TextureStream;
 class MaterialStream;
 class PatchGeometry;
 class DynamicMaterial;
+class Streamer;
+namespace base { class HardwareIndexBuffer; }
 
 /** Interface between scene and landscape */
 class StreamerDrawable : public base::Drawable {
 	friend class Streamer;
 	Landscape* m_land;
+	Streamer*  m_streamer;
 	public:
-	StreamerDrawable(Landscape*);
+	StreamerDrawable(Streamer*, Landscape*);
 	virtual void draw( base::RenderState& );
 	void updateStreamedMaterials(const vec3&, float threshold);
 };
@@ -39,6 +42,16 @@ class Streamer : public Object, public BufferedStream {
 
 	virtual void   setLod(float value);
 
+	/** Vertices along a landscape patch edge, power of 2 plus 1. Applied when the stream is opened */
+	void setPatchSize(int size) { m_patchSize = size; }
+
+	/** Set prefetch distance in pixels around the camera, and how many frames ahead to predict movement */
+	void setPrefetch(int radius, float frames);
+	void updatePrefetch(const vec3& cameraPosition);
+
+	/** Switch patch materials based on camera distance */
+	void updateMaterials(const vec3& cameraPosition);
+
 	// Collision functions
 	virtual float  height( float x, float z, vec3& normal) const;
 	virtual float  height( float x, float z ) const;
@@ -59,19 +72,31 @@ class Streamer : public Object, public BufferedStream {
 	float         m_resolution;
 	Landscape*    m_land;
 	bool          m_swapMaterialFlag;
+	int           m_patchSize;
 
 	StreamerDrawable* m_drawable;
 	MaterialStream*   m_material;
 	
 	float m_encode, m_decode;
 
+	int   m_prefetchRadius;		// Pixels around the camera to keep cached
+	float m_prefetchFrames;		// Frames ahead to predict camera position
+	vec3  m_lastCamera;			// Camera position last frame
+	Point m_lastPrefetch;		// Last requested block
+
+
+	vec3  m_lodCameraPosition;	// Camera position for material lod
+
+	std::map<uint, base::HardwareIndexBuffer*> m_indexBuffers;	// Shared patch index buffers by edge configuration
+	base::HardwareIndexBuffer* getIndexBuffer(const PatchGeometry*);
 
-	// Landscape needs static functions to interface data
-	static Streamer* s_streamer;
-	static float heightFunc(const vec3&);
-	static void  patchCreated(PatchGeometry*);
-	static void  patchDestroyed(PatchGeometry*);
-	static void  updatePatchMaterial(PatchGeometry*);
+	// Landscape callbacks
+	float heightFunc(const vec3&);
+	void  heightBlockFunc(const vec3&, float, const Rect&, float*);
+	void  patchCreated(PatchGeometry*);
+	void  patchDestroyed(PatchGeometry*);
+	void  patchUpdated(PatchGeometry*);
+	void  updatePatchMaterial(PatchGeometry*);
 };
 
 
@@ -1,18 +1,35 @@
 #include "texturestream.h"
 #include <base/opengl.h>
+#include <algorithm>
 #include <cstdio>
+#include <thread>
 
-TextureStream::TextureStream(): m_divisions(0), m_textures(0), m_ref(0), m_overlap(false) {}
+static void merge(Rect& r, const Rect& a) {
+	if(r.width<=0 || r.height<=0) r = a;
+	else r.include(a);
+}
+
+TextureStream::TextureStream(): m_divisions(0), m_textures(0), m_ref(0), m_update(0), m_overlap(false), m_state(0), m_pin(0), m_budget(256<<20),
+	m_pbo(0), m_globalSize(1024), m_globalWidth(0), m_globalHeight(0), m_globalData(0), m_workerRunning(false) {
+	memset(&m_info, 0, sizeof(m_info));
+}
 TextureStream::~TextureStream() {
+	stopWorkerThread();
+	delete [] m_globalData;
+	for(uint i=0; i<m_loaded.size(); ++i) delete [] m_loaded[i].data;
 	// Destroy all textures
 	if(m_textures) {
 		m_global.destroy();
 		for(int i=0; i<m_divisions * m_divisions; ++i) {
-			if(m_ref[i]>0) m_textures[i].destroy();
+			if(m_state[i]==RESIDENT) m_textures[i].destroy();
 		}
 		delete [] m_textures;
 		delete [] m_ref;
+		delete [] m_update;
+		delete [] m_state;
+		delete [] m_pin;
 	}
+	if(m_pbo) glDeleteBuffers(1, &m_pbo);
 }
 
 void TextureStream::initialise(int max, bool overlap) {
@@ -30,39 +47,119 @@ void TextureStream::initialise(int max, bool overlap) {
 	int count = m_divisions * m_divisions;
 	m_textures = new Texture[count];
 	m_ref = new int[count];
+	m_update = new Rect[count];
+	m_state = new char[count];
+	m_pin = new char[count];
 	memset(m_ref, 0, count * sizeof(int));
+	memset(m_state, UNLOADED, count);
+	memset(m_pin, 0, count);
 
 	const int M = 0x7fffffff;
 	m_dirty.set(M,M,-M,-M);
 }
 
 int TextureStream::setPixel(int x, int y, void* pixel) {
-	m_dirty.include(x, y);
+	markDirty( Rect(x, y, 1, 1) );
 	return BufferedStream::setPixel(x, y, pixel);
 }
 int TextureStream::setPixels(const Rect& rect, void* data) {
-	m_dirty.include(rect);
+	markDirty(rect);
 	return BufferedStream::setPixels(rect, data);
 }
 
+void TextureStream::markDirty(const Rect& rect) {
+	m_dirty.include(rect);
+	if(!m_textures) return;
+	// Only loaded sub-textures need updating. Overlapping textures share edge pixels.
+	// Textures still loading may have been read before this change
+	int divX = std::max(1, width() / m_divisions);
+	int divY = std::max(1, height() / m_divisions);
+	int x0 = std::max(0, rect.x / divX - 1), x1 = std::min(m_divisions-1, rect.right() / divX);
+	int y0 = std::max(0, rect.y / divY - 1), y1 = std::min(m_divisions-1, rect.bottom() / divY);
+	for(int x=x0; x<=x1; ++x) for(int y=y0; y<=y1; ++y) {
+		int k = x + y * m_divisions;
+		if(m_state[k]==UNLOADED) continue;
+		Rect r = getPixelRect(x, y);
+		if(!r.intersects(rect)) continue;
+		merge(m_update[k], r.intersect(rect));
+	}
+}
+void TextureStream::closeStream() {
+	stopWorkerThread();
+	BufferedStream::closeStream();
+}
+
 Texture& TextureStream::getGlobalTexture() {
-	if(m_global.width()==0) createGlobalTexture(128);
+	if(m_global.width()==0) createGlobalTexture(m_globalSize);
+	else updateGlobalTexture();
 	return m_global;
 }
 
+void TextureStream::setGlobalSize(int size) {
+	m_globalSize = size;
+}
+
 Texture& TextureStream::getTexture(int x, int y) {
 	int k = x + y * m_divisions;
-	if(m_ref[k]==0) createTexture(x, y);
+	if(m_pin[k]) {
+		m_pin[k] = 0;
+		m_pinned.erase(std::find(m_pinned.begin(), m_pinned.end(), k));
+	}
+	else if(m_state[k]==RESIDENT && m_ref[k]==0) m_lru.remove(k);
 	++m_ref[k];
+	if(m_state[k]!=RESIDENT) {
+		createTexture(x, y);
+		evictTextures();
+	}
 	return m_textures[k];
 }
 void TextureStream::dropTexture(int x, int y) {
 	int k = x + y * m_divisions;
-	if(m_ref[k]==1) {
-//		printf("Destroy texture %d,%d : %u\n", x, y, m_textures[k].unit());
+	if(m_ref[k]>0 && --m_ref[k]==0) {
+		m_lru.push_back(k);
+		evictTextures();
+	}
+}
+
+bool TextureStream::requestTexture(int x, int y) {
+	int k = x + y * m_divisions;
+	if(m_state[k]==RESIDENT) {
+		if(m_pin[k]) m_pin[k] = 2;	// Still wanted, but its material may be waiting for other layers
+		return true;
+	}
+	if(m_state[k]==UNLOADED) {
+		m_state[k] = LOADING;
+		++m_info.loading;
+		startWorkerThread();
+		std::lock_guard<std::mutex> lock(m_workerMutex);
+		m_loadQueue.push_back(k);
+		m_workerSignal.notify_one();
+	}
+	return false;
+}
+
+void TextureStream::setTextureBudget(size_t bytes) {
+	m_budget = bytes;
+	evictTextures();
+}
+
+void TextureStream::evictTextures() {
+	while(m_info.bytes > m_budget && !m_lru.empty()) {
+		int k = m_lru.front();
+		m_lru.pop_front();
+		Rect r = getPixelRect(k % m_divisions, k / m_divisions);
 		m_textures[k].destroy();
+		m_textures[k] = Texture();
+		m_update[k] = Rect(0,0,0,0);
+		m_state[k] = UNLOADED;
+		m_info.bytes -= (size_t)r.width * r.height * pixelSize();
+		--m_info.resident;
+		++m_info.evictions;
 	}
-	if(m_ref[k]>0) --m_ref[k];
+}
+
+TextureStream::ResidencyInfo TextureStream::getResidencyInfo() const {
+	return m_info;
 }
 
 int TextureStream::getDivisions() const {
@@ -87,11 +184,22 @@ Rect TextureStream::getPixelRect(int x, int y) const {
 	return Rect((int)fa.x, (int)fa.y, (int)(fb.x-fa.x), (int)(fb.y-fa.y));
 }
 
-void TextureStream::createTexture(int x, int y) {
+void TextureStream::createTexture(int x, int y, const char* data) {
 	int k = x + y * m_divisions;
 	Rect r = getPixelRect(x, y);
-	char* data = new char[ r.width * r.height * pixelSize() ];
-	getPixels(r, data);
+	char* buffer = 0;
+	if(!data) {
+		data = buffer = new char[ (size_t)r.width * r.height * pixelSize() ];
+		getPixels(r, buffer);
+		m_update[k] = Rect(0,0,0,0);
+	}
+	if(m_state[k]==LOADING) --m_info.loading;
+	if(m_state[k]!=RESIDENT) {
+		m_state[k] = RESIDENT;
+		m_info.bytes += (size_t)r.width * r.height * pixelSize();
+		++m_info.resident;
+		++m_info.loads;
+	}
 	if(m_textures[k].width()!=r.width) {
 		m_textures[k] = Texture::create(r.width, r.height, (Texture::Format) channels(), data);
 		m_textures[k].setWrap( Texture::CLAMP );
@@ -101,44 +209,211 @@ void TextureStream::createTexture(int x, int y) {
 		m_textures[k].bind();
 		glTexImage2D( GL_TEXTURE_2D, 0, fmt, r.width, r.height, 0, fmt, GL_UNSIGNED_BYTE, data);
 	}
-	delete [] data;
+	delete [] buffer;
 }
 
 void TextureStream::createGlobalTexture(int size) {
-	// On the offchance that the image is small
-	if(width()<=size && height()<=size) {
-		char* data = new char[ width() * height() * pixelSize() ];
-		m_global = Texture::create(width(), height(), (Texture::Format) channels(), data);
-		delete [] data;
-		printf("No global texture\n");
-		return;
+	// Small images are copied as they are
+	m_globalWidth = std::min(width(), size);
+	m_globalHeight = std::min(height(), size);
+	int w = m_globalWidth, h = m_globalHeight;
+
+	// Start with nearest pixels from the file overviews if they line up. Filtered data replaces it when ready
+	size_t bytes = (size_t)w * h * pixelSize();
+	m_globalData = new ubyte[bytes];
+	int step = width() / w;
+	if(width()%w==0 && height()%h==0 && height()/h==step) getSamples(0, 0, step, w, h, m_globalData);
+	else memset(m_globalData, 0, bytes);
+	m_global = Texture::create(w, h, (Texture::Format)channels(), m_globalData);
+	printf("Global texture created (%dx%d)\n", w, h);
+
+	startWorkerThread();
+	queueGlobal( Rect(0, 0, w, h) );
+}
+
+void TextureStream::startWorkerThread() {
+	std::lock_guard<std::mutex> lock(m_workerMutex);
+	if(m_workerRunning) return;
+	m_workerRunning = true;
+	m_workerThread.begin(this, &TextureStream::workerThread);
+}
+
+void TextureStream::stopWorkerThread() {
+	{
+		std::lock_guard<std::mutex> lock(m_workerMutex);
+		m_workerRunning = false;
+		m_workerSignal.notify_one();
 	}
+	while(m_workerThread.running()) std::this_thread::yield();
+}
 
-	// lets just use nearest pixel for now (super slow - perhaps back thread it)
-	char* data = new char[ size * size * pixelSize() ];
-	for(int x=0; x<size; ++x) for(int y=0; y<size; ++y) {
-		char* p = data + (x + y*size) * pixelSize();
-		getPixel(x*width()/size, y*height()/size, p);
+void TextureStream::queueGlobal(const Rect& r) {
+	std::lock_guard<std::mutex> lock(m_workerMutex);
+	merge(m_globalDirty, r);
+	m_workerSignal.notify_one();
+}
+
+void TextureStream::workerThread() {
+	// Sub-texture loads come first. The global texture is filtered a band of rows at a time in between
+	const int band = 16;
+	std::vector<ubyte> data;
+	std::unique_lock<std::mutex> lock(m_workerMutex);
+	while(m_workerRunning) {
+		if(!m_loadQueue.empty()) {
+			Load load;
+			load.index = m_loadQueue.front();
+			m_loadQueue.erase(m_loadQueue.begin());
+			lock.unlock();
+			Rect r = getPixelRect(load.index % m_divisions, load.index / m_divisions);
+			load.data = new char[ (size_t)r.width * r.height * pixelSize() ];
+			getPixels(r, load.data);
+			lock.lock();
+			m_loaded.push_back(load);
+		}
+		else if(m_globalDirty.width>0 && m_globalDirty.height>0) {
+			Rect b(m_globalDirty.x, m_globalDirty.y, m_globalDirty.width, std::min(band, m_globalDirty.height));
+			m_globalDirty.y += b.height;
+			m_globalDirty.height -= b.height;
+			lock.unlock();
+			data.resize((size_t)b.width * b.height * pixelSize());
+			filterGlobal(b, &data[0]);
+			lock.lock();
+			// Copy into global image
+			size_t row = b.width * pixelSize();
+			for(int j=0; j<b.height; ++j) {
+				memcpy(m_globalData + ((size_t)(b.y+j) * m_globalWidth + b.x) * pixelSize(), &data[j*row], row);
+			}
+			merge(m_globalReady, b);
+		}
+		else m_workerSignal.wait(lock);
+	}
+}
+
+void TextureStream::filterGlobal(const Rect& r, ubyte* out) {
+	// Read source pixels for a run of output texels at a time
+	const int run = 64;
+	const int bytes = pixelSize();
+	const int w = width(), h = height();
+	const int gw = m_globalWidth, gh = m_globalHeight;
+	std::vector<ubyte> src;
+	uint sum[4];
+	for(int oy=r.y; oy<r.bottom(); ++oy) {
+		int sy = oy * h / gh;
+		int sh = std::max(1, (oy+1) * h / gh - sy);
+		for(int ox=r.x; ox<r.right(); ox+=run) {
+			int end = std::min(ox + run, r.right());
+			int sx = ox * w / gw;
+			Rect s(sx, sy, std::max(1, end * w / gw - sx), sh);
+			src.resize((size_t)s.width * s.height * bytes);
+			getPixels(s, &src[0]);
+			// Average each texel footprint
+			for(int o=ox; o<end; ++o) {
+				int a = o * w / gw - sx;
+				int b = std::max(a+1, (o+1) * w / gw - sx);
+				memset(sum, 0, sizeof(sum));
+				for(int j=0; j<sh; ++j) {
+					const ubyte* p = &src[((size_t)j * s.width + a) * bytes];
+					for(int i=a; i<b; ++i) for(int c=0; c<bytes; ++c) sum[c] += *p++;
+				}
+				uint n = (b - a) * sh;
+				ubyte* t = out + ((size_t)(oy - r.y) * r.width + o - r.x) * bytes;
+				for(int c=0; c<bytes; ++c) t[c] = (sum[c] + n/2) / n;
+			}
+		}
 	}
-	m_global = Texture::create(size, size, (Texture::Format)channels(), data);
-	printf("Global texture created (%dx%d)\n", size, size);
-	delete [] data;
+}
+
+void TextureStream::updateGlobalTexture() {
+	if(m_global.width()==0) return;
+	std::lock_guard<std::mutex> lock(m_workerMutex);
+	Rect& r = m_globalReady;
+	if(r.width<=0 || r.height<=0) return;
+	// Pack region rows
+	const int bytes = pixelSize();
+	size_t row = r.width * bytes;
+	ubyte* data = beginUpload(row * r.height);
+	if(data) for(int j=0; j<r.height; ++j) {
+		memcpy(data + j*row, m_globalData + ((size_t)(r.y+j) * m_globalWidth + r.x) * bytes, row);
+	}
+	endUpload(m_global, r, data);
+	r = Rect(0,0,0,0);
+}
+
+ubyte* TextureStream::beginUpload(size_t bytes) {
+	if(!m_pbo) glGenBuffers(1, &m_pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo);
+	// Orphan old contents so we never wait for a pending transfer
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, 0, GL_STREAM_DRAW);
+	return (ubyte*) glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+}
+
+void TextureStream::endUpload(Texture& tex, const Rect& r, bool mapped) {
+	if(mapped && glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+		const GLenum formats[] = { 0, GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA };
+		tex.bind();
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.width, r.height, formats[ channels() ], GL_UNSIGNED_BYTE, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 void TextureStream::updateTextures() {
-	if(m_dirty.width==0 || m_dirty.height==0) return;
-	// Which textures need updating
-	int div = width() / m_divisions;
-	Point a(m_dirty.x / div, m_dirty.y / div);
-	Point b(m_dirty.right() / div, m_dirty.bottom() / div);
-	// Recreate these textures if they are loaded
-	for(int x=a.x; x<=b.x; ++x) for(int y=a.y; y<=b.y; ++y) {
-		int k = x + y * m_divisions;
-		if(m_ref[k]>0) {
-			createTexture(x, y);
+	updateGlobalTexture();
+
+	// Loaded sub-textures that were not requested since the last update can be evicted
+	for(size_t i=0; i<m_pinned.size(); ) {
+		int k = m_pinned[i];
+		if(--m_pin[k] > 0) ++i;
+		else {
+			m_lru.push_back(k);
+			m_pinned[i] = m_pinned.back();
+			m_pinned.pop_back();
+		}
+	}
+
+	// Create sub-textures that finished loading. They are pinned so eviction can't drop them before they are used
+	std::vector<Load> loaded;
+	{
+		std::lock_guard<std::mutex> lock(m_workerMutex);
+		loaded.swap(m_loaded);
+	}
+	for(uint i=0; i<loaded.size(); ++i) {
+		int k = loaded[i].index;
+		if(m_state[k]==LOADING) {
+			createTexture(k % m_divisions, k / m_divisions, loaded[i].data);
+			if(m_ref[k]==0) {
+				m_pin[k] = 2;
+				m_pinned.push_back(k);
+			}
+		}
+		delete [] loaded[i].data;
+	}
+	evictTextures();
+
+	// Upload changed regions of loaded sub-textures
+	for(int k=0; m_textures && k<m_divisions*m_divisions; ++k) {
+		Rect& r = m_update[k];
+		if(r.width<=0 || r.height<=0) continue;
+		if(m_state[k]==LOADING) continue;	// Uploaded once the load finishes, as it may have read older pixels
+		if(m_state[k]==RESIDENT) {
+			Rect t = getPixelRect(k % m_divisions, k / m_divisions);
+			ubyte* data = beginUpload((size_t)r.width * r.height * pixelSize());
+			if(data) getPixels(r, data);
+			endUpload(m_textures[k], Rect(r.x-t.x, r.y-t.y, r.width, r.height), data);
 		}
+		r = Rect(0,0,0,0);
+	}
+
+	if(m_dirty.width<=0 || m_dirty.height<=0) return;
+	// Refilter the part of the global texture that changed
+	if(m_globalData) {
+		int x0 = m_dirty.x * m_globalWidth / width();
+		int y0 = m_dirty.y * m_globalHeight / height();
+		int x1 = std::min(m_globalWidth, m_dirty.right() * m_globalWidth / width() + 1);
+		int y1 = std::min(m_globalHeight, m_dirty.bottom() * m_globalHeight / height() + 1);
+		queueGlobal( Rect(std::max(x0,0), std::max(y0,0), x1-std::max(x0,0), y1-std::max(y0,0)) );
 	}
-	// Also perhaps update global texture (part of)
 
 	const int M = 0x7fffffff;
 	m_dirty.set(M,M,-M,-M);
@@ -280,6 +555,10 @@ void MaterialStream::build() {
 }
 
 
+void MaterialStream::update() {
+	for(uint i=0; i<m_streams.size(); ++i) m_streams[i].texture->updateTextures();
+}
+
 int MaterialStream::getDivisions() const {
 	return m_divisions;
 }
@@ -306,6 +585,14 @@ Material* MaterialStream::getMaterial(int x, int y) {
 	int k = x + y * m_divisions;
 	SubMaterial& m = m_materials[k];
 	if(!m.material) {
+		// Use the global material until all sub-textures are resident
+		bool ready = true;
+		for(uint i=0; i<m_streams.size(); ++i) {
+			int d = m_divisions / m_streams[i].texture->getDivisions();
+			if(!m_streams[i].texture->requestTexture(x/d, y/d)) ready = false;
+		}
+		if(!ready) return getGlobal();
+
 		// Create material
 		m.material = m_template->clone();
 
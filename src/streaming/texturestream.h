@@ -16,18 +16,36 @@ class TextureStream : public BufferedStream {
 	virtual ~TextureStream();
 	virtual int  setPixel(int x, int y, void* pixel);
 	virtual int  setPixels(const Rect& rect, void* data);
+	virtual void closeStream();
 
 	void     initialise(int maxResolution, bool overlap);	// Determine split size
 	int      getDivisions() const;							// Get split count
 	Rect     getPixelRect(int x, int y) const;				// get rectangle of a sub-texture
-	Texture& getTexture(int x, int y);						// Get sub-texture (reference counted. creates if null)
-	void     dropTexture(int x, int y);						// Drop a sub-texture (reference counted)
+	Texture& getTexture(int x, int y);						// Get sub-texture (reference counted. loads if not resident)
+	void     dropTexture(int x, int y);						// Drop a sub-texture. Stays resident until over budget
+	bool     requestTexture(int x, int y);					// Is a sub-texture resident. Starts loading it in the background if not
+	void     setTextureBudget(size_t bytes);				// Memory for resident sub-textures. Default 256mb
 	Texture& getGlobalTexture();							// Get the global texture lod
+	void     setGlobalSize(int size);						// Maximum global texture size. Use before it is created. Default 1024
 	void     updateTextures();								// Reload any changes to the gpu texture
+	void     updateGlobalTexture();							// Upload any finished global texture regions
+
+	/** Sub-texture residency statistics */
+	struct ResidencyInfo { int resident, loading, loads, evictions; size_t bytes; };
+	ResidencyInfo getResidencyInfo() const;
 
 	protected:
-	void createTexture(int x, int y);						// Create sub-texture
+	void createTexture(int x, int y, const char* data=0);	// Create sub-texture. Reads the stream if no data given
+	void evictTextures();									// Destroy unreferenced sub-textures while over budget
+	void markDirty(const Rect& rect);						// Flag changed pixels
+	ubyte* beginUpload(size_t bytes);						// Map the staging buffer
+	void endUpload(Texture& tex, const Rect& rect, bool mapped);	// Copy staging buffer to a texture region
 	void createGlobalTexture(int size);						// Generate global texture
+	void queueGlobal(const Rect& rect);						// Regenerate global texels in the background
+	void filterGlobal(const Rect& rect, ubyte* out);		// Box filter global texels from the stream
+	void startWorkerThread();
+	void stopWorkerThread();
+	void workerThread();
 
 	protected:
 	Rect     m_dirty;
@@ -35,7 +53,32 @@ class TextureStream : public BufferedStream {
 	Texture* m_textures;
 	Texture  m_global;
 	int*     m_ref;
+	Rect*    m_update;			// Changed pixels in each sub-texture
 	bool     m_overlap;
+
+	enum TextureState { UNLOADED, LOADING, RESIDENT };
+	char*          m_state;		// TextureState of each sub-texture
+	std::list<int> m_lru;		// Resident unreferenced sub-textures, least recently used first
+	std::vector<int> m_pinned;	// Loaded sub-textures kept off the lru until they are used
+	char*          m_pin;		// Updates left before a pinned sub-texture joins the lru. Renewed by requestTexture
+	size_t         m_budget;
+	ResidencyInfo  m_info;
+	struct Load { int index; char* data; };
+	std::vector<int>  m_loadQueue;	// Sub-textures for the worker to read
+	std::vector<Load> m_loaded;		// Finished reads waiting for upload
+
+	uint     m_pbo;		// Staging buffer for texture uploads. Orphaned on each upload
+
+	int      m_globalSize;					// Maximum global texture size
+	int      m_globalWidth, m_globalHeight;	// Actual global texture size
+	ubyte*   m_globalData;					// Filtered global texture
+	Rect     m_globalDirty;					// Texels waiting to be filtered
+	Rect     m_globalReady;					// Texels waiting to be uploaded
+
+	base::Thread            m_workerThread;	// Loads sub-textures and filters the global texture
+	std::mutex              m_workerMutex;
+	std::condition_variable m_workerSignal;
+	bool                    m_workerRunning;
 };
 
 
@@ -52,6 +95,7 @@ class MaterialStream {
 	void setTexture(const char* name, const Texture& texture);	// Set non-streamed texture
 	void updateShader();										// Copy shader program from template
 	void build();												// Ensure submaterias are created
+	void update();												// Upload finished background texture work
 
 	int       getDivisions() const;			// Number of subdivisions
 	Material* getTemplate() const;			// Get template material. This is the one sent in the constructor.
@@ -5,6 +5,13 @@
 #include <cstring>
 #include <ctime>
 #include "tiff.h"
+#include <zlib.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 enum Tiff_FTag {
 	NEW_SUB_FILE_TYPE          = 254,	// 4,1,0
@@ -30,6 +37,17 @@ enum Tiff_FTag {
 	GRAY_RESPONSE_UNIT         = 290,
 	PREDICTOR                  = 317,
 	ARTIST                     = 315,
+	TILE_WIDTH                 = 322,	// 3,1,256
+	TILE_LENGTH                = 323,	// 3,1,256
+	TILE_OFFSETS               = 324,	// 4,N,?		* image data *
+	TILE_BYTE_COUNTS           = 325,	// 4,N,?
+};
+
+enum Tiff_Compression {
+	COMPRESS_NONE        = 1,
+	COMPRESS_LZW         = 5,
+	COMPRESS_DEFLATE     = 8,
+	COMPRESS_DEFLATE_OLD = 32946,
 };
 
 enum Tiff_FType {
@@ -37,16 +55,18 @@ enum Tiff_FType {
 	STRING   = 2,
 	WORD     = 3,
 	DWORD    = 4,
-	RATIONAL = 5
+	RATIONAL = 5,
+	QWORD    = 16,	// BigTIFF only
 };
 
+/** Field descriptor. Classic tiff stores 32bit length/offset, BigTIFF 64bit */
 struct Tiff_IFD {
 	unsigned short tag;
 	unsigned short type;
-	unsigned int   length;
-	unsigned int   offset;
+	uint64_t       length;
+	uint64_t       offset;	// Value if it fits in the descriptor, otherwise a file offset
 };
-inline void setTiffDesc(Tiff_IFD& d, unsigned short tag, unsigned short type, unsigned int length, unsigned int offset) {
+inline void setTiffDesc(Tiff_IFD& d, unsigned short tag, unsigned short type, uint64_t length, uint64_t offset) {
 	d.tag=tag; d.type=type; d.length=length; d.offset=offset;
 }
 
@@ -55,9 +75,84 @@ inline void setTiffDesc(Tiff_IFD& d, unsigned short tag, unsigned short type, un
 
 // Implementation
 
+typedef uint64_t qword;
 typedef unsigned int dword;
 typedef unsigned short word;
 
+// 64bit file offsets
+inline int seek(FILE* fp, qword offset) {
+	#ifdef WIN32
+	return _fseeki64(fp, offset, SEEK_SET);
+	#else
+	return fseeko(fp, offset, SEEK_SET);
+	#endif
+}
+
+inline qword tell(FILE* fp) {
+	#ifdef WIN32
+	return _ftelli64(fp);
+	#else
+	return ftello(fp);
+	#endif
+}
+
+inline size_t typeSize(word type) {
+	switch(type) {
+	case WORD:     return 2;
+	case DWORD:    return 4;
+	case RATIONAL: return 8;
+	case QWORD:    return 8;
+	default:       return 1;
+	}
+}
+
+static void readDesc(FILE* fp, bool big, Tiff_IFD& d) {
+	word head[2];
+	fread(head, 2, 2, fp);
+	d.tag = head[0];
+	d.type = head[1];
+	d.length = d.offset = 0;
+	fread(&d.length, big? 8: 4, 1, fp);
+	fread(&d.offset, big? 8: 4, 1, fp);
+}
+
+static void writeDesc(FILE* fp, bool big, const Tiff_IFD& d) {
+	fwrite(&d.tag, 2, 1, fp);
+	fwrite(&d.type, 2, 1, fp);
+	fwrite(&d.length, big? 8: 4, 1, fp);
+	fwrite(&d.offset, big? 8: 4, 1, fp);
+}
+
+// Read integer array values from a descriptor. Small arrays are stored in the descriptor itself
+static void readArray(FILE* fp, bool big, const Tiff_IFD& d, qword* out) {
+	size_t size = typeSize(d.type);
+	size_t bytes = size * d.length;
+	char* data = new char[bytes];
+	if(bytes <= (big? 8u: 4u)) memcpy(data, &d.offset, bytes);
+	else {
+		seek(fp, d.offset);
+		fread(data, size, d.length, fp);
+	}
+	for(qword i=0; i<d.length; ++i) {
+		switch(size) {
+		case 2:  out[i] = ((word*)data)[i]; break;
+		case 4:  out[i] = ((dword*)data)[i]; break;
+		case 8:  out[i] = ((qword*)data)[i]; break;
+		default: out[i] = ((ubyte*)data)[i]; break;
+		}
+	}
+	delete [] data;
+}
+
+
+static void writeZeros(FILE* fp, size_t bytes) {
+	static const int bs = 6000;
+	char buffer[bs];
+	memset(buffer, 0, bs);
+	while(bytes>bs) bytes -= fwrite(buffer, 1, bs, fp);
+	if(bytes>0) fwrite(buffer, 1, bytes, fp);
+}
+
 
 TiffStream* TiffStream::openStream( const char* file, Mode mode) {
 	const char* modes[3] = { "rb", "wb", "r+b" };
@@ -65,173 +160,467 @@ TiffStream* TiffStream::openStream( const char* file, Mode mode) {
 	if(!fp) return 0;
 
 
-	// Read header
+	// Read header. BigTIFF has version 43 followed by the offset size
 	char header[4];
 	fread(header, 4, 1, fp);
-	if(header[0]!='I' || header[1]!='I' || header[2]!=42 || header[3]!=0) {
+	bool big = header[2]==43;
+	if(header[0]!='I' || header[1]!='I' || (header[2]!=42 && header[2]!=43) || header[3]!=0) {
 		printf("Invalid TIFF header\n");
 		fclose(fp);
 		fp = 0;
 		return 0;
 	}
+	if(big) {
+		word bigHeader[2];
+		fread(bigHeader, 2, 2, fp);
+		if(bigHeader[0]!=8 || bigHeader[1]!=0) {
+			printf("Invalid BigTIFF header\n");
+			fclose(fp);
+			return 0;
+		}
+	}
 
 	TiffStream* img = new TiffStream();
 	img->m_stream = fp;
-	dword stripOffsets = 0;
-	dword stripCount = 0;
+	img->m_mode = mode;
+	img->m_bigTiff = big;
+
+	// First directory is the full image
+	qword offset = 0;
+	fread(&offset, big? 8: 4, 1, fp);
+	if(!img->readDirectory(offset)) {
+		delete img;
+		return 0;
+	}
+
+	// Any following reduced resolution directories are overview levels
+	while(offset) {
+		TiffStream* level = new TiffStream();
+		level->m_stream = fp;
+		level->m_mode = mode;
+		level->m_bigTiff = big;
+		level->m_shared = true;
+		if(!level->readDirectory(offset) || !(level->m_subfileType&1)) {
+			delete level;
+			break;
+		}
+		img->m_overviews.push_back(level);
+	}
+
+	img->mapFile(mode);
+	return img;
+}
+
+bool TiffStream::readDirectory(qword& offset) {
+	FILE* fp = m_stream;
+	bool big = m_bigTiff;
+	Tiff_IFD dataOffsets = {0,0,0,0};
+	Tiff_IFD byteCounts = {0,0,0,0};
+	Tiff_IFD bitsPerSample = {0,0,0,0};
+	uint rowsPerStrip = 0;
+	uint tileWidth = 0, tileHeight = 0;
 
 	// Read field descriptors
-	word count;
-	dword offset;
-	fread(&offset, 4, 1, fp);
+	qword count = 0;
 	Tiff_IFD desc;
-	while(offset>0) {
-		fseek(fp, offset, SEEK_SET);
-		fread(&count, 2, 1, fp);
-		for(word i=0; i<count; ++i) {
-			fread(&desc, 12, 1, fp);
-			//printf("Tag: %d %d %d %d\n", desc.tag, desc.type, desc.length, desc.offset);
-			// Handle descriptor
-			switch(desc.tag) {
-			case WIDTH:           img->m_width = desc.offset; break;
-			case HEIGHT:          img->m_height = desc.offset; break;
-			case BITS_PER_SAMPLE: img->m_bitsPerSample = desc.offset&0xffff; break;
-			case COMPRESSION: if(desc.offset!=1) { printf("Error: Image compressed\n"); return 0; }
-			case PHOTOMETRIC_INTERPRETATION: break;
-			case STRIP_OFFSETS:
-				stripCount = desc.length;
-				stripOffsets = desc.offset; // If length>1, this is a pointer
-				break;
-			case SAMPLES_PER_PIXEL: img->m_samplesPerPixel = desc.offset; break;
-			case ROWS_PER_STRIP:    img->m_rowsPerStrip = desc.offset; break;
-			default: break;
+	seek(fp, offset);
+	fread(&count, big? 8: 2, 1, fp);
+	for(qword i=0; i<count; ++i) {
+		readDesc(fp, big, desc);
+		qword valuePosition = tell(fp) - (big? 8: 4);
+		//printf("Tag: %d %d %d %d\n", desc.tag, desc.type, desc.length, desc.offset);
+		// Handle descriptor
+		switch(desc.tag) {
+		case NEW_SUB_FILE_TYPE: m_subfileType = desc.offset; break;
+		case WIDTH:           m_width = desc.offset; break;
+		case HEIGHT:          m_height = desc.offset; break;
+		case BITS_PER_SAMPLE: bitsPerSample = desc; break;
+		case COMPRESSION:
+			m_compression = desc.offset;
+			if(desc.offset!=COMPRESS_NONE && desc.offset!=COMPRESS_LZW && desc.offset!=COMPRESS_DEFLATE && desc.offset!=COMPRESS_DEFLATE_OLD) {
+				printf("Error: Unsupported compression %u\n", (uint)desc.offset);
+				return false;
 			}
+			break;
+		case PREDICTOR: m_predictor = desc.offset; break;
+		case PHOTOMETRIC_INTERPRETATION: break;
+		case STRIP_OFFSETS:
+		case TILE_OFFSETS:	// If length>1, this is a pointer
+			dataOffsets = desc;
+			m_offsetTable = TableRef{ valuePosition, desc.offset, desc.type };
+			break;
+		case STRIP_BYTE_COUNTS:
+		case TILE_BYTE_COUNTS:
+			byteCounts = desc;
+			m_countTable = TableRef{ valuePosition, desc.offset, desc.type };
+			break;
+		case SAMPLES_PER_PIXEL: m_samplesPerPixel = desc.offset; break;
+		case ROWS_PER_STRIP:    rowsPerStrip = desc.offset; break;
+		case TILE_WIDTH:        tileWidth = desc.offset; break;
+		case TILE_LENGTH:       tileHeight = desc.offset; break;
+		default: break;
 		}
-		fread(&offset, 4, 1, fp);
 	}
+	m_nextEntry = tell(fp);
+	offset = 0;
+	fread(&offset, big? 8: 4, 1, fp);
 
-	// Fix bitsPerSample (assume it is a word)
-	if(img->m_samplesPerPixel>1) {
-		fseek(fp, img->m_bitsPerSample, SEEK_SET);
-		word b[4] = {0,0,0,0};
-		fread(b, img->m_samplesPerPixel, 2, fp);
-		img->m_bitsPerSample = b[0];
-		//printf("bps: %d %d %d %d\n", b[0], b[1], b[2], b[3]);
+	// Bits per sample has a value for each channel - assume they are the same
+	if(bitsPerSample.length > 0) {
+		qword* bits = new qword[ bitsPerSample.length ];
+		readArray(fp, big, bitsPerSample, bits);
+		m_bitsPerSample = bits[0];
+		delete [] bits;
 	}
 
-	// Update strip offsets
-	if(stripCount>1) {
-		img->m_stripCount = stripCount;
-		img->m_stripOffsets = new uint[ stripCount ];
-		fseek(fp, stripOffsets, SEEK_SET);
-		fread(img->m_stripOffsets, 4, stripCount, fp);
-	} else if(stripCount==1) {
-		img->m_stripCount = 1;
-		img->m_stripOffsets = new uint[1];
-		img->m_stripOffsets[0] = stripOffsets;
+	// Strips are treated as tiles the width of the image
+	m_tiled = tileWidth && tileHeight;
+	if(m_tiled) setLayout(tileWidth, tileHeight);
+	else setLayout(m_width, rowsPerStrip && rowsPerStrip<m_height? rowsPerStrip: m_height);
+	if(dataOffsets.length < m_tileCount) {
+		printf("Error: Expected %u image blocks, found %u\n", m_tileCount, (uint)dataOffsets.length);
+		return false;
 	}
 
+	if(m_predictor!=1 && (m_predictor!=2 || m_bitsPerSample%8)) {
+		printf("Error: Unsupported predictor %u\n", m_predictor);
+		return false;
+	}
 
-	return img;
+	// Read data offsets
+	m_tileOffsets = new qword[ dataOffsets.length ];
+	readArray(fp, big, dataOffsets, m_tileOffsets);
 
+	// Compressed data needs the size of each block
+	if(byteCounts.length >= m_tileCount) {
+		m_tileByteCounts = new qword[ byteCounts.length ];
+		readArray(fp, big, byteCounts, m_tileByteCounts);
+	} else if(encoded()) {
+		printf("Error: Missing byte counts for compressed image\n");
+		return false;
+	}
+	return true;
 }
 
-TiffStream* TiffStream::createStream(const char* file, int w, int h, int ch, int bpc, Mode mode, void* data, size_t len) {
+TiffStream* TiffStream::createStream(const char* file, int w, int h, int ch, int bpc, Mode mode, void* data, size_t len, int tileSize, bool bigTiff) {
 	// Create a tiff file
 	const char* modes[] = { 0, "rb", "wb", "w+b" };
 	FILE* fp = fopen(file, modes[mode]);
 	if(!fp) return 0;
 
-	const char* software = "Heightmap Editor";
-	char dateTime[21] = "YYYY:MM:DD HH::MM:SS";
-	time_t t = time(0);
-	strftime(dateTime, 21, "%Y:%m:%d %T", localtime(&t));
-
-
-	// Write header
-	fwrite("II*", 1, 4, fp);
-
-	// Create strea1
+	// Create stream
 	TiffStream* img = new TiffStream();
 	img->m_stream = fp;
+	img->m_mode = mode;
 	img->m_width = w;
 	img->m_height = h;
 	img->m_samplesPerPixel = ch;
 	img->m_bitsPerSample = bpc;
-	img->m_rowsPerStrip = h;
-	img->m_stripCount = 1;
-	img->m_stripOffsets = new uint[1];
 
+	// Tile dimensions must be a multiple of 16
+	bool tiled = tileSize > 0;
+	if(tiled) tileSize = (tileSize + 15) & ~15;
+	img->m_tiled = tiled;
+	if(tiled) img->setLayout(tileSize, tileSize);
+	else img->setLayout(w, h);	// All rows in one strip
+
+	// Use BigTIFF if offsets will not fit in 32 bits
+	const qword limit = 0xffffffffu - 0x10000;	// Allow for header data
+	bool big = bigTiff || (qword)img->m_tileCount * img->tileBytes() > limit;
+	img->m_bigTiff = big;
+
+	// Write header
+	qword offset = big? 16: 8;	// Offset of descriptors
+	if(big) {
+		word bigHeader[2] = { 8, 0 };
+		fwrite("II+", 1, 4, fp);
+		fwrite(bigHeader, 2, 2, fp);
+		fwrite(&offset, 8, 1, fp);
+	} else {
+		fwrite("II*", 1, 4, fp);
+		fwrite(&offset, 4, 1, fp);
+	}
+	img->writeDirectory(offset, 0);
+
+	// Initialise data. Tiled data needs rearranging so is written after
+	size_t bytes = img->m_tileCount * img->tileBytes();
+	size_t imageBytes = (size_t)w * h * ch * (bpc/8);
+	bool initialise = data && (len==0 || len==imageBytes);
+	if(initialise && !tiled) fwrite(data, 1, bytes, fp);
+	else writeZeros(fp, bytes);
 
-	// Create field descriptors
-	dword offset = 8;
-	fwrite(&offset, 1, 4, fp); // Offset of descriptors
+	fflush(fp);
+	img->mapFile(mode);
+	if(initialise && tiled) img->writeBlock(0, 0, w, h, data);
+	return img;
+}
+
+qword TiffStream::writeDirectory(qword offset, uint subfileType) {
+	FILE* fp = m_stream;
+	bool big = m_bigTiff;
+	bool tiled = this->tiled();
+	qword tileCount = m_tileCount;
+	qword tileBytes = this->tileBytes();
+	word offsetType = big? QWORD: DWORD;
+	word sizeType = m_width>0xffff || m_height>0xffff? DWORD: WORD;
+
+	const char* software = "Heightmap Editor";
+	char dateTime[21] = "YYYY:MM:DD HH::MM:SS";
+	time_t t = time(0);
+	strftime(dateTime, 21, "%Y:%m:%d %T", localtime(&t));
+
+	// Create field descriptors - must be in tag order
 	Tiff_IFD desc[20];
-	setTiffDesc(desc[0],  NEW_SUB_FILE_TYPE,          DWORD, 1, 0);
-	setTiffDesc(desc[1],  WIDTH,                      WORD,  1, w);	// can be DWORD
-	setTiffDesc(desc[2],  HEIGHT,                     WORD,  1, h);
-	setTiffDesc(desc[3],  BITS_PER_SAMPLE,            WORD,  1, bpc);
-	setTiffDesc(desc[4],  COMPRESSION,                WORD,  1, 1);				// No Compression
-	setTiffDesc(desc[5],  PHOTOMETRIC_INTERPRETATION, WORD,  1, 1);
-	setTiffDesc(desc[6],  STRIP_OFFSETS,              DWORD, 1, 0); 			// Image data offset - Will be static
-	setTiffDesc(desc[7],  ORIENTATION,                WORD,  1, 1);
-	setTiffDesc(desc[8],  SAMPLES_PER_PIXEL,          WORD,  1, ch);
-	setTiffDesc(desc[9],  ROWS_PER_STRIP,             WORD,  1, h); 			// All rows in one strip
-	setTiffDesc(desc[10], STRIP_BYTE_COUNTS,          DWORD, 1, w*h*ch*(bpc/8));
-	setTiffDesc(desc[11], X_RESOLUTION,               RATIONAL, 1, 0);		// Umm, meh
-	setTiffDesc(desc[12], Y_RESOLUTION,               RATIONAL, 1, 0);
-	setTiffDesc(desc[13], RESOLUTION_UNIT,            WORD,   1, 2);
-	setTiffDesc(desc[14], SOFTWARE,                   STRING, strlen(software), 0); // calulate offset
-	setTiffDesc(desc[15], DATE_TIME,                  STRING, 20, 0);
-	word count = 16;
-
-	offset += sizeof(word) + count * sizeof(Tiff_IFD) + sizeof(dword);
-	desc[11].offset = offset; offset+=8;
-	desc[12].offset = offset; offset+=8;
-	desc[14].offset = offset; offset+=desc[14].length;
-	desc[15].offset = offset; offset+=desc[15].length;
-	desc[ 6].offset = offset; offset+=desc[10].offset; // Data
-	img->m_stripOffsets[0] = desc[6].offset;
+	word count = 0;
+	Tiff_IFD* dataOffsets = 0;
+	Tiff_IFD* byteCounts = 0;
+	setTiffDesc(desc[count++], NEW_SUB_FILE_TYPE,          DWORD, 1, subfileType);
+	setTiffDesc(desc[count++], WIDTH,                      sizeType, 1, m_width);
+	setTiffDesc(desc[count++], HEIGHT,                     sizeType, 1, m_height);
+	setTiffDesc(desc[count++], BITS_PER_SAMPLE,            WORD,  1, m_bitsPerSample);
+	setTiffDesc(desc[count++], COMPRESSION,                WORD,  1, 1);				// No Compression
+	setTiffDesc(desc[count++], PHOTOMETRIC_INTERPRETATION, WORD,  1, 1);
+	if(!tiled) {
+		dataOffsets = desc + count;
+		setTiffDesc(desc[count++], STRIP_OFFSETS,          offsetType, 1, 0); 		// Image data offset - Will be static
+	}
+	setTiffDesc(desc[count++], ORIENTATION,                WORD,  1, 1);
+	setTiffDesc(desc[count++], SAMPLES_PER_PIXEL,          WORD,  1, m_samplesPerPixel);
+	if(!tiled) {
+		setTiffDesc(desc[count++], ROWS_PER_STRIP,         sizeType, 1, m_height);
+		byteCounts = desc + count;
+		setTiffDesc(desc[count++], STRIP_BYTE_COUNTS,      offsetType, 1, tileBytes);
+	}
+	Tiff_IFD* xResolution = desc + count;
+	setTiffDesc(desc[count++], X_RESOLUTION,               RATIONAL, 1, 0);		// Umm, meh
+	setTiffDesc(desc[count++], Y_RESOLUTION,               RATIONAL, 1, 0);
+	setTiffDesc(desc[count++], RESOLUTION_UNIT,            WORD,   1, 2);
+	Tiff_IFD* strings = desc + count;
+	setTiffDesc(desc[count++], SOFTWARE,                   STRING, strlen(software), 0); // calulate offset
+	setTiffDesc(desc[count++], DATE_TIME,                  STRING, 20, 0);
+	if(tiled) {
+		setTiffDesc(desc[count++], TILE_WIDTH,             WORD,  1, m_tileWidth);
+		setTiffDesc(desc[count++], TILE_LENGTH,            WORD,  1, m_tileHeight);
+		dataOffsets = desc + count;
+		setTiffDesc(desc[count++], TILE_OFFSETS,           offsetType, tileCount, 0);
+		byteCounts = desc + count;
+		setTiffDesc(desc[count++], TILE_BYTE_COUNTS,       offsetType, tileCount, tileBytes);
+	}
+
+	// Calculate offsets. BigTIFF descriptors are 20 bytes, with 8 byte count and next offset.
+	size_t offsetSize = big? 8: 4;
+	qword start = offset;
+	offset += big? 8 + count * 20 + 8: 2 + count * 12 + 4;
+	xResolution[0].offset = offset; offset+=8;
+	xResolution[1].offset = offset; offset+=8;
+	strings[0].offset = offset; offset+=strings[0].length;
+	strings[1].offset = offset; offset+=strings[1].length;
+	if(tileCount>1) {
+		// Offset tables
+		dataOffsets->offset = offset; offset += tileCount * offsetSize;
+		byteCounts->offset = offset;  offset += tileCount * offsetSize;
+	}
+	delete [] m_tileOffsets;
+	m_tileOffsets = new qword[ tileCount ];
+	for(qword i=0; i<tileCount; ++i) m_tileOffsets[i] = offset + i * tileBytes;
+	if(tileCount==1) dataOffsets->offset = offset;
 
 	// Write descriptors
-	dword next = 0;
-	fwrite(&count, sizeof(word), 1, fp);
-	fwrite(desc, sizeof(Tiff_IFD), count, fp);
-	fwrite(&next, sizeof(dword), 1, fp);
+	qword next = 0;
+	qword descCount = count;
+	seek(fp, start);
+	fwrite(&descCount, big? 8: 2, 1, fp);
+	for(word i=0; i<count; ++i) writeDesc(fp, big, desc[i]);
+	m_nextEntry = tell(fp);
+	fwrite(&next, offsetSize, 1, fp);
 
 	// Write data
 	dword resolution[2] = { 720000, 10000 }; // RATIONAL: numerator, denominator
 	fwrite(resolution, 4, 2, fp);
 	fwrite(resolution, 4, 2, fp);
-	fwrite(software, 1, desc[14].length, fp);
-	fwrite(dateTime, 1, desc[15].length, fp);
+	fwrite(software, 1, strings[0].length, fp);
+	fwrite(dateTime, 1, strings[1].length, fp);
+	if(tileCount>1) {
+		for(qword i=0; i<tileCount; ++i) fwrite(m_tileOffsets+i, offsetSize, 1, fp);
+		for(qword i=0; i<tileCount; ++i) fwrite(&tileBytes, offsetSize, 1, fp);
+	}
+	return offset;	// Image data follows
+}
 
-	// Initialise data
-	size_t bytes = desc[10].offset;
-	if(data && (len==0 || len==bytes)) fwrite(data, 1, bytes, fp);
-	else {
-		// Set all pixels to 0
-		static const int bs = 6000;
-		char buffer[bs];
-		memset(buffer, 0, bs);
-		for(dword i=0; bytes>bs; i+=bs) bytes -= fwrite(buffer, 1, bs, fp);
-		if(bytes>0) fwrite(buffer, 1, bytes, fp);
-	}
-		
-	return img;
+bool TiffStream::convertToTiled(const char* source, const char* destination, int tileSize) {
+	TiffStream* src = openStream(source, READ);
+	if(!src) return false;
+	TiffStream* dst = createStream(destination, src->m_width, src->m_height, src->m_samplesPerPixel, src->m_bitsPerSample, READWRITE, 0, 0, tileSize);
+	if(!dst) {
+		delete src;
+		return false;
+	}
+
+	// Copy a row of tiles at a time
+	uint rows = dst->m_tileHeight;
+	char* band = new char[ (size_t)src->m_width * rows * (src->bpp()/8) ];
+	for(uint y=0; y<src->m_height; y+=rows) {
+		uint h = y+rows > src->m_height? src->m_height-y: rows;
+		src->readBlock(0, y, src->m_width, h, band);
+		dst->writeBlock(0, y, src->m_width, h, band);
+	}
+	printf("Converted %s to %ux%u tiles\n", source, dst->m_tileWidth, dst->m_tileHeight);
+	delete [] band;
+	delete src;
+	delete dst;
+	return true;
+}
+
+void TiffStream::setLayout(uint tileWidth, uint tileHeight) {
+	m_tileWidth = tileWidth;
+	m_tileHeight = tileHeight;
+	m_tilesAcross = (m_width + tileWidth - 1) / tileWidth;
+	m_tileCount = m_tilesAcross * ((m_height + tileHeight - 1) / tileHeight);
+}
+
+inline size_t TiffStream::tileBytes() const {
+	return (size_t)m_tileWidth * m_tileHeight * (m_bitsPerSample/8 * m_samplesPerPixel);
+}
+
+bool TiffStream::mapFile(Mode mode) {
+	#ifndef WIN32
+	if(!(mode&READ) || m_tileCount==0 || encoded()) return false;	// mmap needs read access
+	struct stat info;
+	int fd = fileno(m_stream);
+	if(fstat(fd, &info)!=0 || info.st_size<=0) return false;
+
+	if(!checkExtents(info.st_size)) return false;
+
+	int prot = mode&WRITE? PROT_READ|PROT_WRITE: PROT_READ;
+	void* map = mmap(0, info.st_size, prot, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) return false;
+	madvise(map, info.st_size, MADV_RANDOM);
+	m_map = (ubyte*)map;
+	m_mapSize = info.st_size;
+	m_pageSize = sysconf(_SC_PAGESIZE);
+	m_dirtyPages.assign((m_mapSize + m_pageSize - 1) / m_pageSize, false);
+
+	// Overview levels use the same mapping
+	for(TiffStream* level: m_overviews) {
+		if(level->encoded() || !level->checkExtents(m_mapSize)) continue;
+		level->m_map = m_map;
+		level->m_mapSize = m_mapSize;
+		level->m_pageSize = m_pageSize;
+		level->m_dirtyPages.assign(m_dirtyPages.size(), false);
+	}
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+void TiffStream::unmapFile() {
+	#ifndef WIN32
+	for(TiffStream* level: m_overviews) level->m_map = 0;
+	if(m_map && !m_shared) munmap(m_map, m_mapSize);
+	#endif
+	m_map = 0;
+	m_mapSize = 0;
+}
+
+bool TiffStream::checkExtents(size_t fileSize) {
+	// Check all data lies within the file. The last strip may be short.
+	size_t size = tileBytes();
+	size_t last = (m_height - (m_tileCount-1) * m_tileHeight) * (size / m_tileHeight);
+	m_contiguous = !tiled();
+	for(uint i=0; i<m_tileCount; ++i) {
+		size_t end = m_tileOffsets[i] + (!tiled() && i==m_tileCount-1? last: size);
+		if(end > fileSize) return false;
+		if(i>0 && m_tileOffsets[i] != m_tileOffsets[i-1] + size) m_contiguous = false;
+	}
+	return true;
+}
+
+inline void TiffStream::markDirty(size_t addr, size_t len) {
+	size_t last = (addr + len - 1) / m_pageSize;
+	for(size_t page = addr / m_pageSize; page<=last; ++page) m_dirtyPages[page] = true;
+}
+
+int TiffStream::flush() {
+	updateOverviews();
+	int count = flushData();
+	for(TiffStream* level: m_overviews) count += level->flush();
+	return count;
+}
+
+int TiffStream::flushData() {
+	if(encoded()) {
+		// Recompress modified tiles
+		int count = 0;
+		for(auto& i: m_cache) {
+			if(i.second.dirty) {
+				encodeTile(i.first, i.second.data);
+				i.second.dirty = false;
+				++count;
+			}
+		}
+		if(m_tablesChanged) {
+			writeTable(m_offsetTable, m_tileOffsets);
+			writeTable(m_countTable, m_tileByteCounts);
+			m_tablesChanged = false;
+		}
+		fflush(m_stream);
+		return count;
+	}
+
+	#ifndef WIN32
+	if(!m_map) return 0;
+	// Sync runs of dirty pages
+	int count = 0;
+	size_t pages = m_dirtyPages.size();
+	for(size_t i=0; i<pages; ++i) {
+		if(!m_dirtyPages[i]) continue;
+		size_t end = i;
+		while(end<pages && m_dirtyPages[end]) m_dirtyPages[end++] = false;
+		size_t length = (end - i) * m_pageSize;
+		if(i*m_pageSize + length > m_mapSize) length = m_mapSize - i*m_pageSize;
+		msync(m_map + i*m_pageSize, length, MS_SYNC);
+		count += end - i;
+		i = end;
+	}
+	return count;
+	#else
+	return 0;
+	#endif
 }
 
 inline size_t TiffStream::getAddress(int x, int y) const {
-	uint strip = y / m_rowsPerStrip;
-	uint index = x + (y-strip*m_rowsPerStrip) * m_width;
+	uint tile = x / m_tileWidth + y / m_tileHeight * m_tilesAcross;
+	size_t index = x % m_tileWidth + (size_t)(y % m_tileHeight) * m_tileWidth;
 	uint bpp = m_bitsPerSample/8 * m_samplesPerPixel;
-	return m_stripOffsets[strip] + bpp*index;
+	return m_tileOffsets[tile] + bpp*index;
+}
+
+const void* TiffStream::rowPointer(int y) const {
+	if(!m_map || tiled() || y<0 || y>=(int)m_height) return 0;
+	return m_map + getAddress(0, y);
+}
+
+bool TiffStream::blockView(const Rect& r, BlockView& out) const {
+	if(!m_map || r.width<=0 || r.height<=0) return false;
+	if(r.x<0 || r.y<0 || r.right()>(int)m_width || r.bottom()>(int)m_height) return false;
+	// Rows are only evenly spaced within a tile, or if strips are contiguous
+	bool singleTile = r.x / m_tileWidth == (r.right()-1) / m_tileWidth && r.y / m_tileHeight == (r.bottom()-1) / m_tileHeight;
+	if(!singleTile && !m_contiguous) return false;
+	out.data = m_map + getAddress(r.x, r.y);
+	out.stride = m_tileWidth * (m_bitsPerSample/8 * m_samplesPerPixel);
+	return true;
 }
 
 
 size_t TiffStream::getPixel(int x, int y, void* data) const {
+	if(encoded()) return readBlock(x, y, 1, 1, data) * m_samplesPerPixel;
 	size_t addr = getAddress(x, y);
-	fseek(m_stream, addr, SEEK_SET);
+	if(m_map) {
+		memcpy(data, m_map + addr, m_bitsPerSample/8 * m_samplesPerPixel);
+		return m_samplesPerPixel;
+	}
+	seek(m_stream, addr);
 	#ifdef LINUX
 	if(feof(m_stream)) asm("int $3");
 	#endif
@@ -239,47 +628,518 @@ size_t TiffStream::getPixel(int x, int y, void* data) const {
 }
 
 size_t TiffStream::setPixel(int x, int y, void* data) {
+	if(encoded()) return writeBlock(x, y, 1, 1, data) * m_samplesPerPixel;
+	markPending(x, y, 1, 1);
 	size_t addr = getAddress(x, y);
-	fseek(m_stream, addr, SEEK_SET);
+	if(m_map) {
+		size_t bytes = m_bitsPerSample/8 * m_samplesPerPixel;
+		memcpy(m_map + addr, data, bytes);
+		markDirty(addr, bytes);
+		return m_samplesPerPixel;
+	}
+	seek(m_stream, addr);
 	return fwrite(data, m_bitsPerSample/8, m_samplesPerPixel, m_stream);
 }
 
 
 size_t TiffStream::readBlock(int x, int y, int width, int height, void* data) const {
-	if(x<=-width || y<=-height || x>=(int)m_width || y>=(int)m_height) return 0;	// fully outside image
-	// assume data is correctly allocated
-	uint bytes = m_bitsPerSample/8 * m_samplesPerPixel;
-	size_t offset = x<0? -x: 0;
-	size_t len = x+width > (int)m_width? m_width-x-offset: width-offset;
-	size_t count = 0;
-	int y0 = y<0? -y: 0;
-	int y1 = y+height > (int)m_height? m_height-y: height;
-	for(int i=y0; i<y1; ++i) {
-		size_t addr = getAddress(x+offset, y+i);
-		fseek(m_stream, addr, SEEK_SET);
-		count += fread((char*)data + i * bytes * width + offset*bytes, bytes, len, m_stream);
-	}
-	return count;
+	// Reading does not modify anything
+	return const_cast<TiffStream*>(this)->transfer(x, y, width, height, (char*)data, false);
 }
 size_t TiffStream::writeBlock(int x, int y, int width, int height, void* data) {
-	if(x<=-width || y<=-height || x>=(int)m_width || y>=(int)m_height) return 0;	// fully outside image
-	uint bytes = m_bitsPerSample/8 * m_samplesPerPixel;
-	size_t offset = x<0? -x: 0;
-	size_t len = x+width > (int)m_width? m_width-x-offset: width-offset;
+	return transfer(x, y, width, height, (char*)data, true);
+}
+
+size_t TiffStream::transfer(int x, int y, int width, int height, char* data, bool write) {
+	// Clip to image. Data outside the image is left untouched
+	int x0 = x<0? 0: x;
+	int y0 = y<0? 0: y;
+	int x1 = x+width > (int)m_width? m_width: x+width;
+	int y1 = y+height > (int)m_height? m_height: y+height;
+	if(x0>=x1 || y0>=y1) return 0;	// fully outside image
+	if(write) markPending(x0, y0, x1-x0, y1-y0);
+
+	const size_t bytes = m_bitsPerSample/8 * m_samplesPerPixel;
+	const size_t pitch = width * bytes;
+	const size_t tilePitch = m_tileWidth * bytes;
+	const int tw = m_tileWidth, th = m_tileHeight;
 	size_t count = 0;
-	int y0 = y<0? -y: 0;
-	int y1 = y+height > (int)m_height? m_height-y: height;
-	for(int i=y0; i<y1; ++i) {
-		size_t addr = getAddress(x+offset, y+i);
-		fseek(m_stream, addr, SEEK_SET);
-		count += fwrite((char*)data + i * bytes * width + offset * bytes, bytes, len, m_stream);
+
+	// Process each tile the block overlaps
+	for(int ty=y0/th*th; ty<y1; ty+=th) {
+		int r0 = ty>y0? ty: y0;
+		int r1 = ty+th<y1? ty+th: y1;
+		int rows = r1 - r0;
+		for(int tx=x0/tw*tw; tx<x1; tx+=tw) {
+			int c0 = tx>x0? tx: x0;
+			int c1 = tx+tw<x1? tx+tw: x1;
+			size_t len = (c1 - c0) * bytes;
+			size_t addr = getAddress(c0, r0);
+			char* block = data + (r0-y)*pitch + (c0-x)*bytes;
+			count += (c1 - c0) * rows;
+
+			if(encoded()) {
+				uint index = tx/tw + ty/th * m_tilesAcross;
+				ubyte* tile = getTile(index, write) + ((size_t)(r0-ty) * tw + (c0-tx)) * bytes;
+				for(int i=0; i<rows; ++i) {
+					if(write) memcpy(tile + i*tilePitch, block + i*pitch, len);
+					else memcpy(block + i*pitch, tile + i*tilePitch, len);
+				}
+				continue;
+			}
+
+			if(m_map) {
+				for(int i=0; i<rows; ++i) {
+					if(write) memcpy(m_map + addr + i*tilePitch, block + i*pitch, len);
+					else memcpy(block + i*pitch, m_map + addr + i*tilePitch, len);
+				}
+				if(write) markDirty(addr, (rows-1) * tilePitch + len);
+				continue;
+			}
+
+			// Rows within a tile are sequential in the file, so access them in one go
+			// unless most of the span would be data outside the block
+			size_t span = (rows-1) * tilePitch + len;
+			bool merge = span != rows * len;	// Span includes data outside the block
+			if(span > rows * len * 4 || (write && merge && !(m_mode&READ))) {
+				for(int i=0; i<rows; ++i) {
+					seek(m_stream, addr + i*tilePitch);
+					if(write) fwrite(block + i*pitch, 1, len, m_stream);
+					else fread(block + i*pitch, 1, len, m_stream);
+				}
+				continue;
+			}
+
+			if(m_scratch.size() < span) m_scratch.resize(span);
+			char* s = &m_scratch[0];
+			seek(m_stream, addr);
+			if(!write || merge) {
+				fread(s, 1, span, m_stream);
+				seek(m_stream, addr);
+			}
+			for(int i=0; i<rows; ++i) {
+				if(write) memcpy(s + i*tilePitch, block + i*pitch, len);
+				else memcpy(block + i*pitch, s + i*tilePitch, len);
+			}
+			if(write) fwrite(s, 1, span, m_stream);
+		}
 	}
 	return count;
 }
 
 
 TiffStream::~TiffStream() {
-	if(m_stream) fclose(m_stream);
+	if(m_stream) flush();
+	for(auto& i: m_cache) delete [] i.second.data;
+	for(TiffStream* level: m_overviews) delete level;
+	m_overviews.clear();
+	unmapFile();
+	if(m_stream && !m_shared) fclose(m_stream);
+	delete [] m_tileOffsets;
+	delete [] m_tileByteCounts;
+}
+
+
+
+// =============================== Overviews =============================== //
+
+bool TiffStream::buildOverviews(uint minSize) {
+	if(!m_overviews.empty()) return true;
+	if(m_mode != READWRITE) return false;
+	flush();
+
+	// Levels are appended to the end of the file. Each is about a quarter the size of the previous
+	fseek(m_stream, 0, SEEK_END);
+	qword end = tell(m_stream);
+	qword total = (qword)m_tileCount * tileBytes() / 3 + 0x10000;
+	if(!m_bigTiff && end + total > 0xffffffffu) {
+		printf("Error: No space for tiff overviews\n");
+		return false;
+	}
+
+	TiffStream* previous = this;
+	uint w = m_width, h = m_height;
+	while(w > minSize || h > minSize) {
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+		TiffStream* level = new TiffStream();
+		level->m_stream = m_stream;
+		level->m_mode = m_mode;
+		level->m_bigTiff = m_bigTiff;
+		level->m_shared = true;
+		level->m_width = w;
+		level->m_height = h;
+		level->m_bitsPerSample = m_bitsPerSample;
+		level->m_samplesPerPixel = m_samplesPerPixel;
+		level->m_tiled = m_tiled;	// Levels may be no wider than a tile
+		if(m_tiled) level->setLayout(m_tileWidth, m_tileHeight);
+		else level->setLayout(w, h);
+
+		// Write directory and empty data, then link it to the previous directory
+		qword start = end + (end & 1);	// Word aligned
+		end = level->writeDirectory(start, 1);
+		writeZeros(m_stream, (size_t)level->m_tileCount * level->tileBytes());
+		end += (qword)level->m_tileCount * level->tileBytes();
+		seek(m_stream, previous->m_nextEntry);
+		fwrite(&start, m_bigTiff? 8: 4, 1, m_stream);
+
+		m_overviews.push_back(level);
+		previous = level;
+	}
+	fflush(m_stream);
+
+	// Remap to include the new data
+	unmapFile();
+	mapFile(m_mode);
+
+	m_pending = Rect(0, 0, m_width, m_height);
+	updateOverviews();
+	flush();
+	return true;
+}
+
+bool TiffStream::testOverviews(const char* file) {
+	// Non-square so some levels are a single tile wide
+	const int w = 1024, h = 2048;
+	TiffStream* s = createStream(file, w, h, 1, 16, READWRITE, 0, 0, 256);
+	if(!s) return printf("Error: Failed to create %s\n", file), false;
+	uint16* data = new uint16[w * h];
+	for(int i=0; i<w*h; ++i) data[i] = (uint16)(i * 2654435761u >> 16);
+	s->writeBlock(0, 0, w, h, data);
+	s->buildOverviews();
+	delete s;
+
+	// Reopen and compare every level with the source pixels
+	size_t bad = 0;
+	s = openStream(file, READ);
+	if(!s) bad = 1;
+	for(uint level=0; s && level<=s->overviewCount(); ++level) {
+		const TiffStream* o = s->getOverview(level);
+		if(o->tiled() != s->tiled()) ++bad;
+		uint16 value;
+		for(uint y=0; y<o->height(); ++y) for(uint x=0; x<o->width(); ++x) {
+			o->getPixel(x, y, &value);
+			if(value != data[(x<<level) + (y<<level) * w]) ++bad;
+		}
+	}
+	printf("Overview test: %u levels, %s\n", s? s->overviewCount(): 0, bad? "FAILED": "passed");
+	delete [] data;
+	delete s;
+	return bad == 0;
+}
+
+void TiffStream::markPending(int x, int y, int w, int h) {
+	if(m_overviews.empty()) return;
+	if(m_pending.width<=0 || m_pending.height<=0) {
+		m_pending = Rect(x, y, w, h);
+		return;
+	}
+	int x1 = x+w > m_pending.right()? x+w: m_pending.right();
+	int y1 = y+h > m_pending.bottom()? y+h: m_pending.bottom();
+	if(x < m_pending.x) m_pending.x = x;
+	if(y < m_pending.y) m_pending.y = y;
+	m_pending.width = x1 - m_pending.x;
+	m_pending.height = y1 - m_pending.y;
+}
+
+void TiffStream::updateOverviews() {
+	if(m_overviews.empty() || m_pending.width<=0 || m_pending.height<=0) return;
+	// Overview pixel (x,y) is pixel (2x,2y) of the previous level, so coarse samples match the full image exactly
+	const size_t bytes = m_bitsPerSample/8 * m_samplesPerPixel;
+	const int band = 64;
+	Rect r = m_pending;
+	TiffStream* source = this;
+	for(TiffStream* level: m_overviews) {
+		int x0 = (r.x+1)/2, y0 = (r.y+1)/2;
+		int x1 = (r.right()+1)/2, y1 = (r.bottom()+1)/2;
+		if(x0>=x1 || y0>=y1) break;
+		int w = x1 - x0;
+		int sw = 2*w - 1;
+		std::vector<char> in((size_t)sw * (2*band-1) * bytes);
+		std::vector<char> out((size_t)w * band * bytes);
+		for(int y=y0; y<y1; y+=band) {
+			int rows = y+band<y1? band: y1-y;
+			source->readBlock(2*x0, 2*y, sw, 2*rows-1, &in[0]);
+			for(int j=0; j<rows; ++j) {
+				for(int i=0; i<w; ++i) memcpy(&out[((size_t)j*w + i)*bytes], &in[((size_t)2*j*sw + 2*i)*bytes], bytes);
+			}
+			level->writeBlock(x0, y, w, rows, &out[0]);
+		}
+		r = Rect(x0, y0, w, y1-y0);
+		source = level;
+	}
+	m_pending = Rect(0,0,0,0);
+}
+
+size_t TiffStream::readSamples(int x, int y, int step, int columns, int rows, void* data) const {
+	// Use the smallest level that contains every sample
+	uint level = 0;
+	while(level < m_overviews.size() && ((x | y | step) & ((2<<level)-1)) == 0) ++level;
+	const TiffStream* source = level? m_overviews[level-1]: this;
+	const size_t bytes = m_bitsPerSample/8 * m_samplesPerPixel;
+	char* out = (char*)data;
+	for(int j=0; j<rows; ++j) {
+		int py = y + j * step;
+		for(int i=0; i<columns; ++i, out+=bytes) {
+			int px = x + i * step;
+			if(px<0 || py<0 || px>=(int)m_width || py>=(int)m_height) memset(out, 0, bytes);
+			else if(level && m_pending.contains(px, py)) getPixel(px, py, out);	// Overview not updated yet
+			else source->getPixel(px >> level, py >> level, out);
+		}
+	}
+	return (size_t)columns * rows;
+}
+
+
+
+// ============================== Compression ============================== //
+
+// Horizontal differencing predictor - each sample is stored as the difference from the previous pixel
+template<typename T> void applyPredictor(T* data, size_t rows, size_t width, uint channels, bool encode) {
+	size_t n = width * channels;
+	for(size_t r=0; r<rows; ++r, data+=n) {
+		if(encode) for(size_t i=n-1; i>=channels; --i) data[i] -= data[i-channels];
+		else for(size_t i=channels; i<n; ++i) data[i] += data[i-channels];
+	}
+}
+static void applyPredictor(ubyte* data, size_t rows, size_t width, uint channels, uint bits, bool encode) {
+	switch(bits) {
+	case 8:  applyPredictor(data, rows, width, channels, encode); break;
+	case 16: applyPredictor((uint16_t*)data, rows, width, channels, encode); break;
+	case 32: applyPredictor((uint32_t*)data, rows, width, channels, encode); break;
+	}
+}
+
+// Tiff LZW: Codes are 9-12 bits, most significant bit first. Code size increases one code early.
+static const uint LZW_CLEAR = 256;
+static const uint LZW_END   = 257;
+static const uint LZW_FIRST = 258;
+
+static bool lzwDecode(const ubyte* in, size_t size, ubyte* out, size_t outSize) {
+	word  prefix[4096], length[4096];
+	ubyte suffix[4096], first[4096];
+	for(uint i=0; i<256; ++i) suffix[i] = first[i] = i, length[i] = 1;
+
+	uint bits = 9, next = LZW_FIRST;
+	int  previous = -1;
+	size_t bit = 0, o = 0;
+	while(o < outSize && bit + bits <= size * 8) {
+		// Read next code
+		size_t p = bit >> 3;
+		uint window = in[p]<<16 | (p+1<size? in[p+1]<<8: 0) | (p+2<size? in[p+2]: 0);
+		uint code = (window >> (24 - bits - (bit&7))) & ((1<<bits)-1);
+		bit += bits;
+
+		if(code == LZW_END) break;
+		if(code == LZW_CLEAR) {
+			bits = 9;
+			next = LZW_FIRST;
+			previous = -1;
+			continue;
+		}
+		if(previous < 0) {
+			if(code > 255) return false;
+			out[o++] = code;
+			previous = code;
+			continue;
+		}
+		if(code > next || next >= 4096) return false;
+
+		// New entry is the previous string plus the first byte of this one
+		prefix[next] = previous;
+		first[next]  = first[previous];
+		suffix[next] = code==next? first[previous]: first[code];
+		length[next] = length[previous] + 1;
+		++next;
+
+		// Output string - walk back from the last character
+		size_t end = o + length[code];
+		size_t i = end;
+		for(uint c=code; ; c=prefix[c]) {
+			if(--i < outSize) out[i] = suffix[c];
+			if(c < 256) break;
+		}
+		o = end;
+		if(next >= (1u<<bits)-1 && bits<12) ++bits;
+		previous = code;
+	}
+	return o >= outSize;
+}
+
+static void lzwEncode(const ubyte* in, size_t size, std::vector<ubyte>& out) {
+	// Dictionary is a hash table of (prefix code, byte) pairs
+	const uint hashSize = 1<<13;
+	std::vector<int>  keys(hashSize, -1);
+	std::vector<word> codes(hashSize);
+	uint bits = 9, next = LZW_FIRST;
+	uint buffer = 0, count = 0;
+	auto write = [&](uint code) {
+		buffer = buffer<<bits | code;
+		for(count+=bits; count>=8; count-=8) out.push_back(buffer >> (count-8));
+	};
+	auto reset = [&]() {
+		std::fill(keys.begin(), keys.end(), -1);
+		next = LZW_FIRST;
+		bits = 9;
+	};
+	// Add a dictionary entry, clearing the table when full
+	auto add = [&]() {
+		if(++next == 4094) {
+			write(LZW_CLEAR);
+			reset();
+		}
+		else if(next > (1u<<bits)-1) ++bits;
+	};
+
+	out.clear();
+	write(LZW_CLEAR);
+	if(size) {
+		uint string = in[0];
+		for(size_t i=1; i<size; ++i) {
+			int key = string<<8 | in[i];
+			uint h = ((uint)key * 2654435761u) >> 19;
+			while(keys[h]>=0 && keys[h]!=key) h = (h+1) & (hashSize-1);
+			if(keys[h] == key) {
+				string = codes[h];
+				continue;
+			}
+			write(string);
+			keys[h] = key;
+			codes[h] = next;
+			add();
+			string = in[i];
+		}
+		write(string);
+		add();	// Reader adds an entry for the last code too
+	}
+	write(LZW_END);
+	if(count) out.push_back(buffer << (8-count));
+}
+
+// =========================== Tile Cache ============================= //
+
+size_t TiffStream::chunkBytes(uint index) const {
+	if(tiled()) return tileBytes();
+	// Last strip may be short
+	uint row = index * m_tileHeight;
+	uint rows = row + m_tileHeight > m_height? m_height - row: m_tileHeight;
+	return (size_t)rows * m_width * (m_bitsPerSample/8 * m_samplesPerPixel);
+}
+
+ubyte* TiffStream::getTile(uint index, bool write) {
+	auto it = m_cache.find(index);
+	if(it == m_cache.end()) {
+		size_t bytes = tileBytes();
+		while(!m_lru.empty() && m_cacheSize + bytes > m_cacheLimit) evictTile();
+		CachedTile& tile = m_cache[index];
+		tile.data = new ubyte[bytes];
+		tile.dirty = false;
+		m_lru.push_front(index);
+		tile.lru = m_lru.begin();
+		m_cacheSize += bytes;
+		decodeTile(index, tile.data);
+		tile.dirty = write;
+		return tile.data;
+	}
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	if(write) it->second.dirty = true;
+	return it->second.data;
+}
+
+void TiffStream::evictTile() {
+	uint index = m_lru.back();
+	CachedTile& tile = m_cache[index];
+	if(tile.dirty) encodeTile(index, tile.data);
+	delete [] tile.data;
+	m_cache.erase(index);
+	m_lru.pop_back();
+	m_cacheSize -= tileBytes();
+}
+
+bool TiffStream::decodeTile(uint index, ubyte* out) {
+	size_t bytes = chunkBytes(index);
+	size_t size = m_tileByteCounts[index];
+	memset(out, 0, tileBytes());
+	if(size == 0) return true;	// Empty tile
+
+	if(m_scratch.size() < size) m_scratch.resize(size);
+	ubyte* packed = (ubyte*)&m_scratch[0];
+	seek(m_stream, m_tileOffsets[index]);
+	if(fread(packed, 1, size, m_stream) != size) return false;
+
+	bool result = true;
+	switch(m_compression) {
+	case COMPRESS_NONE:
+		memcpy(out, packed, size<bytes? size: bytes);
+		break;
+	case COMPRESS_LZW:
+		result = lzwDecode(packed, size, out, bytes);
+		break;
+	case COMPRESS_DEFLATE:
+	case COMPRESS_DEFLATE_OLD: {
+		uLongf length = bytes;
+		result = uncompress(out, &length, packed, size) == Z_OK;
+		} break;
+	}
+	if(!result) printf("Error: Failed to decompress tiff block %u\n", index);
+
+	if(m_predictor == 2) applyPredictor(out, bytes / (m_tileWidth*(bpp()/8)), m_tileWidth, m_samplesPerPixel, m_bitsPerSample, false);
+	return result;
 }
 
+bool TiffStream::encodeTile(uint index, const ubyte* data) {
+	if(!(m_mode&WRITE)) return false;
+	size_t bytes = chunkBytes(index);
+
+	// Predictor works on a copy so cached data stays valid
+	std::vector<ubyte> source;
+	if(m_predictor == 2) {
+		source.assign(data, data + bytes);
+		applyPredictor(&source[0], bytes / (m_tileWidth*(bpp()/8)), m_tileWidth, m_samplesPerPixel, m_bitsPerSample, true);
+		data = &source[0];
+	}
+
+	std::vector<ubyte> packed;
+	switch(m_compression) {
+	case COMPRESS_NONE:
+		packed.assign(data, data + bytes);
+		break;
+	case COMPRESS_LZW:
+		lzwEncode(data, bytes, packed);
+		break;
+	case COMPRESS_DEFLATE:
+	case COMPRESS_DEFLATE_OLD: {
+		uLongf length = compressBound(bytes);
+		packed.resize(length);
+		compress2(&packed[0], &length, data, bytes, Z_DEFAULT_COMPRESSION);
+		packed.resize(length);
+		} break;
+	}
 
+	// Overwrite the old data if it fits, otherwise append to the file
+	qword offset = m_tileOffsets[index];
+	if(packed.size() > m_tileByteCounts[index]) {
+		fseek(m_stream, 0, SEEK_END);
+		offset = tell(m_stream);
+		offset += offset & 1;	// Keep word alignment
+	}
+	seek(m_stream, offset);
+	fwrite(&packed[0], 1, packed.size(), m_stream);
+	if(offset != m_tileOffsets[index] || packed.size() != m_tileByteCounts[index]) {
+		m_tileOffsets[index] = offset;
+		m_tileByteCounts[index] = packed.size();
+		m_tablesChanged = true;
+	}
+	return true;
+}
+
+void TiffStream::writeTable(const TableRef& table, const uint64_t* values) {
+	// Small tables are stored in the descriptor itself
+	size_t size = typeSize(table.type);
+	bool inlined = size * m_tileCount <= (m_bigTiff? 8u: 4u);
+	seek(m_stream, inlined? table.entry: table.offset);
+	for(uint i=0; i<m_tileCount; ++i) {
+		if(size<8 && values[i] >> (size*8)) printf("Error: Tiff offset overflow\n");
+		fwrite(values+i, size, 1, m_stream);
+	}
+}
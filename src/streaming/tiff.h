@@ -3,6 +3,10 @@
 
 #include <base/math.h>
 #include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <list>
+#include <unordered_map>
 
 /** Image base class - move this into base ? */
 class Image {
@@ -30,17 +34,32 @@ class Tiff {
 };
 
 
-/** Allow streaming - only uncompressed images */
+/** Allow streaming of large images.
+ *  Supports strip or tiled layouts. Strips are handled as tiles the full width of the image.
+ *  BigTIFF (64bit offsets) is used automatically for images too large for 32bit offsets.
+ *  Uncompressed files are memory mapped where possible, so pixel access avoids seek/read calls.
+ *  LZW and Deflate compressed files are decoded a tile at a time into a limited size cache.
+ *  Modified tiles are recompressed when evicted or flushed.
+ *  Reduced resolution overview levels are stored as extra directories and updated on flush. */
 class TiffStream {
 	public:
 	enum Mode { READ=1, WRITE=2, READWRITE=3 };
+	struct BlockView { const ubyte* data; size_t stride; };	// Pointer to first pixel and row pitch in bytes
 	static TiffStream* openStream(const char* filename, Mode mode=READ);
-	static TiffStream* createStream(const char* filename, int width, int height, int channels, int bitsPerChannel=8, Mode mode=WRITE, void* data=0, size_t length=0);
+	static TiffStream* createStream(const char* filename, int width, int height, int channels, int bitsPerChannel=8, Mode mode=WRITE, void* data=0, size_t length=0, int tileSize=0, bool bigTiff=false);
+	static bool convertToTiled(const char* source, const char* destination, int tileSize=256);
 	bool   good() const     { return m_stream!=0; }
 	uint   bpp()  const     { return m_bitsPerSample * m_samplesPerPixel; }
 	uint   width() const    { return m_width; }
 	uint   height() const   { return m_height; }
 	uint   channels() const { return m_samplesPerPixel; }
+	bool   mapped() const   { return m_map!=0; }
+	bool   tiled() const    { return m_tiled; }
+	bool   bigTiff() const  { return m_bigTiff; }
+	uint   tileWidth() const  { return m_tileWidth; }
+	uint   tileHeight() const { return m_tileHeight; }
+	uint   compression() const { return m_compression; }
+	void   setCacheSize(size_t bytes) { m_cacheLimit = bytes; }	// Memory limit for decompressed tiles
 
 	size_t getPixel(int x, int y, void* data) const;
 	size_t readBlock(int x, int y, int width, int height, void* data) const;
@@ -48,18 +67,80 @@ class TiffStream {
 	size_t setPixel(int x, int y, void* data);
 	size_t writeBlock(int x, int y, int width, int height, void* data);
 
+	bool   buildOverviews(uint minSize=64);					// Append overview levels until the image is minSize
+	uint   overviewCount() const { return m_overviews.size(); }
+	const TiffStream* getOverview(uint level) const { return level? m_overviews[level-1]: this; }	// Level 0 is the full image
+	size_t readSamples(int x, int y, int step, int columns, int rows, void* data) const;	// Pixels spaced step apart, read from an overview if possible
+	static bool testOverviews(const char* filename);		// Round trip check of a non-square tiled file with overviews
+
+	const void* rowPointer(int y) const;					// Direct access to a row of a mapped strip file
+	bool   blockView(const Rect& r, BlockView& out) const;	// Direct access to a block of a mapped file
+	int    flush();											// Write modified data to the file
+
 	~TiffStream();
 
 	private:
 	FILE* m_stream=NULL;
+	Mode  m_mode=READ;
+	bool  m_bigTiff=false;
 	uint  m_width=0, m_height=0;
 	uint  m_bitsPerSample=0;
 	uint  m_samplesPerPixel=0;
-	uint  m_rowsPerStrip=0;
-	uint  m_stripCount=0;
-	uint* m_stripOffsets=0;
+	bool  m_tiled=false;		// Tile tags rather than strips. Tiles may be the full image width
+	uint  m_tileWidth=0;		// Tile size. For strip images tileWidth is the image width
+	uint  m_tileHeight=0;		// and tileHeight is rows per strip
+	uint  m_subfileType=0;
+	uint  m_tilesAcross=0;
+	uint  m_tileCount=0;
+	uint64_t* m_tileOffsets=0;
+	uint64_t* m_tileByteCounts=0;
+	mutable std::vector<char> m_scratch;	// Buffer for reading partial tiles
+	uint64_t m_nextEntry=0;		// File position of next directory offset
+
+	// Overviews. Level n pixel (x,y) is full image pixel (x,y) * 2^n
+	std::vector<TiffStream*> m_overviews;
+	Rect  m_pending = Rect(0,0,0,0);	// Region modified since overviews were updated
+	bool  m_shared=false;				// Overview levels share the file and mapping of the full image
+
+	// Compressed data
+	struct TableRef { uint64_t entry, offset; unsigned short type; };	// File location of an offset table
+	struct CachedTile { ubyte* data; bool dirty; std::list<uint>::iterator lru; };
+	uint     m_compression=1;
+	uint     m_predictor=1;
+	TableRef m_offsetTable = {0,0,0};
+	TableRef m_countTable = {0,0,0};
+	bool     m_tablesChanged=false;
+	std::unordered_map<uint, CachedTile> m_cache;
+	std::list<uint> m_lru;		// Cached tiles, most recently used first
+	size_t   m_cacheSize=0;
+	size_t   m_cacheLimit=64<<20;
+
+	ubyte* m_map=0;					// Memory mapped file data
+	size_t m_mapSize=0;
+	size_t m_pageSize=0;
+	bool   m_contiguous=false;		// Strips are sequential so all rows have a constant stride
+	std::vector<bool> m_dirtyPages;	// Mapped pages modified since last flush
 
+	bool     readDirectory(uint64_t& offset);
+	uint64_t writeDirectory(uint64_t offset, uint subfileType);
+	void     markPending(int x, int y, int width, int height);
+	void     updateOverviews();
+	int      flushData();
 	size_t getAddress(int x, int y) const;
+	size_t tileBytes() const;
+	size_t chunkBytes(uint index) const;
+	bool   encoded() const { return m_compression!=1 || m_predictor!=1; }
+	ubyte* getTile(uint index, bool write);
+	void   evictTile();
+	bool   decodeTile(uint index, ubyte* out);
+	bool   encodeTile(uint index, const ubyte* data);
+	void   writeTable(const TableRef&, const uint64_t* values);
+	void   setLayout(uint tileWidth, uint tileHeight);
+	size_t transfer(int x, int y, int width, int height, char* data, bool write);
+	bool   mapFile(Mode mode);
+	void   unmapFile();
+	bool   checkExtents(size_t fileSize);
+	void   markDirty(size_t address, size_t length);
 };
 
 #endif
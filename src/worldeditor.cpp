@@ -1113,7 +1113,7 @@ bool loadHeightMapData(int size, float* data, const Rangef& range, const char* f
 		TiffStream* tiff = TiffStream::openStream(file);
 		if(!tiff) return false;
 		if(tiff->bpp()==16 && tiff->channels()==1) {
-			uint16* raw = new uint16[tiff->width() * tiff->height()];
+			uint16* raw = new uint16[(size_t)tiff->width() * tiff->height()];
 			tiff->readBlock(0, 0, size, size, raw);
 			uint count = size * size;
 			float scale = range.size() / 0xffff;
@@ -1161,8 +1161,11 @@ void WorldEditor::saveWorld(const char* file) {
 	char* removeExtension = strrchr(name, '.');
 	if(removeExtension) *removeExtension = 0;
 
-	// Flush all streams
-	for(uint i=0; i<m_streams.size(); ++i) m_streams[i]->flush();
+	// Flush all streams. Saving adds overviews to streams opened without them
+	for(uint i=0; i<m_streams.size(); ++i) {
+		m_streams[i]->buildOverviews();
+		m_streams[i]->flush();
+	}
 
 	// Write xml file
 	XML xml;